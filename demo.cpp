@@ -19,6 +19,38 @@ int main(int argc, char* argv[])
     //     (combine with -ra, allow special tests run)
     // -ra=group1 allow the test in region group1 running
     // -rd=group1 disable the test in region group1 running
+    // --jobs=4 run independent tests on 4 threads
+    // --scale run stress and bench tests at 1, 2, 4... hardware threads
+    // --scale=8 the same, up to 8 threads
+    // --profile=t_bench* sample the matching tests into folded stacks
+    //     (--profile-hz=199 in 1..10000, --profile-max=20000 samples per
+    //      test, --profile-out=vtest_profile.folded, link with -rdynamic,
+    //      with --jobs the other running tests are sampled too)
+    // --shard-index=0 --shard-count=4 run one shard of the suite (or
+    //     VTEST_SHARD_INDEX / VTEST_SHARD_COUNT), --result-file=r0.txt
+    //     saves its results, --merge=r0.txt,r1.txt combines them and
+    //     --durations=d.txt records / balances the shards by test time
+    //     (shard_check.sh runs shards as processes and checks the merge)
+    // --memory / --memory=N table of the tests with the largest peak RSS,
+    //     with --client the served child measures and prints its own
+    // --bench-cpus=0,2-3 --bench-cold[=MB] --bench-reps=5 --bench-cv=5
+    //     --bench-retry=2 control the benchmark runs (see ut_bench_env)
+    //     --bench-min-ms=10 least time of each size of VTEST_BENCH_RANGE
+    // --update-golden rewrite the files of EXPECT_MATCHES_GOLDEN
+    // --budget-threads=8 --budget-mem=4096 limit the threads and MB of
+    //     the tests running together, see VTEST_RESOURCES
+    // --max-errors=1000 --max-test-errors=100 failures kept in detail,
+    //     the others are counted by test and by site with case ranges
+    // --batch-max-failures=10 stop a BAT_CHECK loop after 10 failures
+    // --filter=t_batch*,t_var run only the tests matching the globs
+    // --trace=demo_trace.json timeline of the tests, benchmarks, async
+    //     slices, VTEST_TRACE_SCOPE spans and failures for perfetto
+    // --serve=/tmp/demo.sock keep the fixtures warm and run requests of
+    //     --client=/tmp/demo.sock --filter=t_var in forked children
+    // --repeat=50 or --duration=10m soak the tests, report time, RSS and
+    //     allocation growth (--drift=20 %) and flaky tests, allocations
+    //     are counted when one file defines VTEST_TRACK_ALLOC
+    // --shuffle --seed=7 random order per round, the seed is printed
     VTEST_INIT(argc, argv);
 
     // manaul add test function
@@ -88,6 +120,184 @@ VTEST(t_batch_test_with_return_value)
     VBAT_CHECK_2(count, v);
 }
 
+static bool aligned_copy(int size, int align)
+{
+    std::vector<char> a(size + align, 1), b(size + align, 0);
+    memcpy(&b[align], &a[align], size);
+    return memcmp(&a[align], &b[align], size) == 0;
+}
+
+VTEST(t_batch_generator)
+{
+    // the cases are built one by one when checked, the index of the
+    // product is the case number of the report
+    ut_gen_product all = { ut_domain::range(0, 4096, 64), { 0, 1, 8, 16 } };
+    BAT_CHECK_2(aligned_copy, all);
+
+    // every size meets every alignment with far fewer cases
+    ut_gen_pairwise pairs = { ut_domain::range(1, 9), { 0, 1, 8, 16 }, { true, false } };
+    TIP("pairwise: %d cases", (int)pairs.size());
+
+    // 20 random cases of a product too large to run
+    ut_gen_product big = { ut_domain::range(0, 1 << 20), ut_domain::range(0, 64) };
+    ut_gen_sample<ut_gen_product> some = ut_sample(big, 20, 1);
+    BAT_CHECK_2(aligned_copy, some);
+}
+
+constexpr int square(int x) { return x * x; }
+
+// checked by the compiler, no work at run time
+VTEST_CONSTEXPR(t_constexpr)
+{
+    CEXPECT(square(3) == 9)
+    CEXPECT_EQ(square(-4), 16)
+};
+
+VTEST(t_array_near)
+{
+    TIP("compare float arrays, the whole array is one check.");
+    float a[100], b[100];
+    for (int i = 0; i < 100; i++) {
+        a[i] = i * 0.1f;
+        b[i] = a[i] + 0.0001f;
+    }
+    EXPECT_ARRAY_NEAR(a, b, 100, 0.001);
+    // b[i] is far more than 4 ulp away from a[i], report the first mismatches
+    EXPECT_ARRAY_ULP(a, b, 100, 4);
+}
+
+VTEST(t_buffer_eq)
+{
+    TIP("compare byte buffers, show a hexdump around the differences.");
+    unsigned char a[256], b[256];
+    for (int i = 0; i < 256; i++) {
+        a[i] = b[i] = (unsigned char)i;
+    }
+    EXPECT_BUFFER_EQ(a, b, sizeof(a));
+    b[100] = 0;
+    EXPECT_BUFFER_EQ(a, b, sizeof(a));
+}
+
+// run the body on 4 threads, 10000 loops each, the threads start together,
+// each loop does some work of its own and then touches the shared counter
+VTEST_STRESS(t_stress_counter, 4, 10000)
+{
+    static std::atomic<int> counter(0);
+    int sum = 0;
+    while (ctx.next()) {
+        for (int i = 0; i < 100; i++) {
+            sum = count(sum, i);
+            ut_do_not_optimize(sum);
+        }
+        counter++;
+    }
+    EXPECT(ctx.ops() == 10000);
+}
+
+// the same body as a benchmark, 1 thread and ns/op unless run with --scale,
+// ut_do_not_optimize keeps the unused sum from being optimized out
+VTEST_BENCH(t_bench_count, 1000000)
+{
+    int sum = 0;
+    while (ctx.next()) {
+        sum = count(sum, 1);
+        ut_do_not_optimize(sum);
+    }
+}
+
+// ctx.range() is 16, 32, ... 65536, the times are fitted to O(1), O(log n),
+// O(n), O(n log n) and O(n^2), the fit must be linear or better
+VTEST_BENCH_RANGE(t_bench_sum, 16, 65536)
+{
+    std::vector<int> v((size_t)ctx.range(), 1);
+    ctx.reset_timer();
+    int sum = 0;
+    while (ctx.next()) {
+        for (size_t i = 0; i < v.size(); i++) {
+            sum = count(sum, v[i]);
+        }
+        ut_do_not_optimize(sum);
+    }
+}
+VTEST_COMPLEXITY_EXPECT(t_bench_sum, O_N)
+
+// sweep t_stress_counter over the thread counts with --scale, a hard
+// efficiency bound depends on the machine, for example 2 threads must
+// reach 50% would be
+// VTEST_SCALING_EXPECT(t_stress_counter, 2, 0.5)
+
+ut_histogram g_latency;
+
+VTEST_STRESS(t_stress_latency, 2, 10000)
+{
+    // record into thread local counters, merged when rec goes out of scope
+    ut_latency_recorder rec(g_latency);
+    while (ctx.next()) {
+        ut_u64 t0 = ut_clock::now_ns();
+        count(1, 2);
+        rec.record_since(t0);
+    }
+}
+
+VTEST(t_latency_check)
+{
+    g_latency.show("t_stress_latency");
+    EXPECT_P50_BELOW(g_latency, 1000000);
+    EXPECT_P99_BELOW(g_latency, 10000000);
+    EXPECT_MAX_BELOW(g_latency, 1000000000);
+}
+
+// the output is compared with demo_golden.txt while it is produced, run
+// with --update-golden to rewrite the file after a wanted change
+static void write_report(ut_golden& out)
+{
+    // a span of its own on the --trace timeline
+    VTEST_TRACE_SCOPE("write_report");
+    for (int i = 0; i < 100; i++) {
+        char line[64];
+        snprintf(line, sizeof(line), "row %d, value %d\n", i, i * i);
+        out.write(line);
+    }
+}
+
+VTEST(t_golden)
+{
+    EXPECT_MATCHES_GOLDEN("demo_golden.txt", write_report);
+}
+
+#ifdef VTEST_HAS_MEMSTAT
+// the peak RSS growth of the running test, measured from its start,
+// only the tests marked with VTEST_MEMORY are tracked without --memory
+VTEST(t_peak_rss)
+{
+    std::vector<char> v(4 << 20, 1);
+    EXPECT_PEAK_RSS_BELOW(64 << 20);
+}
+VTEST_MEMORY(t_peak_rss)
+#endif
+
+#ifdef VTEST_HAS_COROUTINE
+// async tests are coroutines, all of them run together on one event loop
+// while a worker is idle, each one fails if it is not done in 1000 ms
+VTEST_ASYNC_TIMED(t_async_sleep, 1000)
+{
+    ut_u64 t0 = ut_clock::now_ns();
+    co_await ut_sleep(10);
+    EXPECT(ut_clock::now_ns() - t0 >= 10000000);
+}
+
+// the timeout counts from when the loop takes the test, the slow normal
+// test queued before it does not eat into the 100 ms
+VTEST_ASYNC_TIMED(t_async_queued, 100)
+{
+    co_await ut_sleep(10);
+}
+VTEST(t_slow_normal)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(150));
+}
+#endif
+
 VTEST(t_var)
 {
     TIP("ut_var test...");
@@ -224,4 +434,10 @@ VTEST(t_haha2)
     TIP("k2, from demo");
 }
 
-VTEST_REGION_POP(k2);
\ No newline at end of file
+VTEST_REGION_POP(k2);
+
+// t_haha2 runs after t_haha, and is skipped when t_haha fails
+VTEST_DEPENDS(t_haha2, t_haha)
+
+// t_stress_counter runs 4 threads, with --jobs it takes 4 of the budget
+VTEST_RESOURCES(t_stress_counter, 4, 0)
\ No newline at end of file
@@ -0,0 +1,70 @@
+#!/bin/sh
+# run a suite as N shard processes at once, merge their result files and
+# compare with one unsharded run: every test runs in exactly one shard,
+# the VTEST_TOP_ADD fixture in all of them, the totals match
+#   ./shard_check.sh [N], CXX picks the compiler (g++)
+set -e
+CXX=${CXX:-g++}
+N=${1:-4}
+top=$(cd "$(dirname "$0")" && pwd)
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+cat > "$dir/shard.cpp" <<'SRC'
+#include "vtest.h"
+using namespace vtest;
+static int env_ready = 0;
+void init_env() { env_ready = 1; }
+#define T(n) VTEST(t_##n) { EXPECT(env_ready == 1); EXPECT_EQ(n * 3, n + n + n); }
+T(0) T(1) T(2) T(3) T(4) T(5) T(6) T(7) T(8) T(9)
+T(10) T(11) T(12) T(13) T(14) T(15) T(16) T(17) T(18) T(19)
+int main(int argc, char* argv[])
+{
+    VTEST_INIT(argc, argv);
+    VTEST_TOP_ADD(init_env);
+    return VTEST_RUN_ALL();
+}
+SRC
+$CXX -std=c++11 -O1 -pthread -I"$top" -o "$dir/shard" "$dir/shard.cpp"
+
+"$dir/shard" --result-file="$dir/all.txt" > "$dir/all.log"
+pids=
+files=
+i=0
+while [ $i -lt "$N" ]; do
+    "$dir/shard" --shard-index=$i --shard-count="$N" \
+        --result-file="$dir/r$i.txt" > "$dir/r$i.log" &
+    pids="$pids $!"
+    files="$files,$dir/r$i.txt"
+    i=$((i + 1))
+done
+for p in $pids; do
+    wait "$p" || { echo "shard process $p failed"; exit 1; }
+done
+"$dir/shard" --merge="${files#,}" > "$dir/merge.log" || {
+    echo "merged run failed"; cat "$dir/merge.log"; exit 1; }
+
+fail=0
+cat "$dir"/r*.txt | awk -v n="$N" '
+    $1 == "test" { seen[$2]++ }
+    END {
+        bad = 0
+        for (t in seen) {
+            want = t == "init_env" ? n : 1
+            if (seen[t] != want) { print t " ran " seen[t] " times"; bad = 1 }
+            else if (t != "init_env") tests++
+        }
+        if (tests != 20) { print tests " of 20 tests ran"; bad = 1 }
+        exit bad
+    }' || fail=1
+want=$(awk '$1 == "count" { print $2 }' "$dir/all.txt")
+got=$(cat "$dir"/r*.txt | awk '$1 == "count" { s += $2 } END { print s }')
+if [ "$want" != "$got" ]; then
+    echo "merged count $got, unsharded $want"
+    fail=1
+fi
+if [ $fail -ne 0 ]; then
+    echo "sharding check failed"
+    exit 1
+fi
+echo "sharding check passed, $N shards"
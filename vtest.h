@@ -8,26 +8,131 @@ a simple testing framework
 #ifndef __V_TEST_H__
 #define __V_TEST_H__
 
+// the workers, the scheduler and the async loop need C++11
+#if !defined(_MSC_VER) && __cplusplus < 201103L
+#error "vtest.h needs C++11 or later"
+#endif
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <stdarg.h>
 #include <assert.h>
+#include <math.h>
+#include <time.h>
 #include <vector>
 #include <string>
 #include <map>
+#include <set>
+#include <algorithm>
+#include <deque>
+#include <queue>
+#include <memory>
+#include <condition_variable>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <cstddef>
+#include <unordered_map>
 
 #define VTEST_VERSION "2018"
 
 #ifdef _MSC_VER
 #include <Windows.h>
+#include <intrin.h>
 #ifndef snprintf
 #define snprintf _snprintf_s
 #endif
-#include <unordered_map>
+#endif
 #define UT_HASH_MAP std::unordered_map
-#else
-// NOT C++11
-#include <tr1/unordered_map>
-#define UT_HASH_MAP std::tr1::unordered_map
+
+// vectorized array compare, define VTEST_NO_SIMD to use the scalar loop only
+#ifndef VTEST_NO_SIMD
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define VTEST_SIMD_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
+#define VTEST_SIMD_SSE2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define VTEST_SIMD_NEON
+#endif
+#endif
+
+// sampling profiler of --profile, needs backtrace() and dladdr()
+#if defined(__GLIBC__) || defined(__APPLE__)
+#include <signal.h>
+#include <sys/time.h>
+#include <execinfo.h>
+#include <dlfcn.h>
+#include <cxxabi.h>
+#define VTEST_HAS_PROFILER
+#endif
+
+// per-test peak RSS and page faults, /proc on linux and getrusage
+#if defined(__linux__) || defined(__APPLE__)
+#include <sys/resource.h>
+#define VTEST_HAS_MEMSTAT
+#endif
+
+// golden files are mapped, not read
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#define VTEST_HAS_MMAP
+#endif
+
+// --serve keeps the tests warm behind a unix socket, forks per request
+#if defined(__unix__) || defined(__APPLE__)
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#define VTEST_HAS_SERVE
+#endif
+
+// --bench-cpus pinning
+#ifdef __linux__
+#include <sched.h>
+#define VTEST_HAS_AFFINITY
+#endif
+
+// VTEST_ASYNC needs C++20 coroutines
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#define VTEST_HAS_COROUTINE
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#endif
+#endif
+#endif
+
+// default deadline of a VTEST_ASYNC test in ms
+#ifndef VTEST_ASYNC_TIMEOUT
+#define VTEST_ASYNC_TIMEOUT 10000
+#endif
+
+// max mismatches printed by EXPECT_ARRAY_NEAR/EXPECT_ARRAY_ULP
+#ifndef VTEST_ARRAY_REPORT
+#define VTEST_ARRAY_REPORT 8
+#endif
+
+// differences shown with a hexdump by EXPECT_BUFFER_EQ
+#ifndef VTEST_BUFFER_REPORT
+#define VTEST_BUFFER_REPORT 4
 #endif
 
 namespace vtest
@@ -90,55 +195,139 @@ namespace vtest
     };
     static console& ut_cons = console::instance();
 
+    // glob match with * and ?, used by the name patterns of the options
+    inline bool ut_glob_match(const char* pat, const char* s)
+    {
+        const char* star = NULL;
+        const char* back = NULL;
+        while (*s) {
+            if (*pat == '*') {
+                star = pat++;
+                back = s;
+            }
+            else if (*pat == '?' || *pat == *s) {
+                pat++;
+                s++;
+            }
+            else if (star) {
+                pat = star + 1;
+                s = ++back;
+            }
+            else {
+                return false;
+            }
+        }
+        while (*pat == '*') pat++;
+        return *pat == 0;
+    }
+
+    // live operator new allocations, counted when one source file defines
+    // VTEST_TRACK_ALLOC before including vtest.h, each test keeps its own
+    // share in test_node::allocs
+    inline std::atomic<long long>& ut_live_allocs()
+    {
+        static std::atomic<long long> obj_(0);
+        return obj_;
+    }
+
+    // nonzero while the framework allocates for itself on this thread,
+    // those allocations are not counted and neither is their delete
+    inline int& ut_alloc_quiet()
+    {
+        static thread_local int obj_ = 0;
+        return obj_;
+    }
+
+    class ut_alloc_pause
+    {
+    public:
+        ut_alloc_pause() { ut_alloc_quiet()++; }
+        ~ut_alloc_pause() { ut_alloc_quiet()--; }
+    };
+
     class unit_test
     {
     public:
         void set_exit_on_failed(bool value) { exit_on_failed_ = value; }
         void set_pause_on_exit(bool value) { pause_on_exit_ = value; }
         void set_report_detail(bool value) { report_detail_ = value; }
+        // 0: off, -1: sweep up to the hardware threads, n: sweep up to n
+        void set_scale(int value) { scale_ = value; }
+        int scale() const { return scale_; }
+        // runs the loop of the async tests until one of them has finished
+        void set_async_runner(void(*proc)(void)) { async_runner_ = proc; }
+        int failed() const { return count_ - pass_; }
         int run_all()
         {
-            typedef void(*UNITTEST_PROC)(void);
+            std::string merge, path;
+#ifdef VTEST_HAS_SERVE
+            if (get_option("--client=", path)) {
+                return client(path);
+            }
+            if (get_option("--serve=", path)) {
+                return serve(path);
+            }
+#endif
+            if (get_option("--merge=", merge)) {
+                return merge_results(merge);
+            }
+            if (get_option("--durations=", path)) {
+                read_durations(path);
+            }
             printf("--------------------------------------------------\n");
             printf("Unit test start with vTest %s...\n", VTEST_VERSION);
+            if (shard_count_ > 1) {
+                printf("Shard %d of %d\n", shard_index_, shard_count_);
+            }
+            if (shuffle_) {
+                printf("Shuffled with --seed=%llu\n", seed_);
+            }
             printf("--------------------------------------------------\n");
-            std::vector<func_info>::iterator it;
-            while (!funcs_.empty())
-            {
-                std::vector<func_info> funcs;
-                funcs.swap(funcs_);
-                for (it = funcs.begin(); it != funcs.end(); it++)
+            // --repeat / --duration run the tests again in rounds, the
+            // fixtures of VTEST_TOP_ADD only in the first one
+            std::vector<func_info> again;
+            unsigned long long until = duration_ms_ > 0 ? now_ms() + duration_ms_ : 0;
+            for (round_ = 0; ; ) {
+                while (!funcs_.empty())
                 {
-                    if (level_filter_)
-                    {
-                        map_it_ = map_run_level_.find(it->level);
-                        if (level_check_) {
-                            if (map_it_ != map_run_level_.end()
-                                && map_it_->second == 1)
-                            {
-                                printf("\n[run] %s\n", it->func.c_str());
-                                run_++;
-                                (UNITTEST_PROC(it->ptr))();
-                            }
-                        }
-                        else if (map_it_ == map_run_level_.end()
-                            || map_it_->second == 1)
-                        {
-                            printf("\n[Run] %s\n", it->func.c_str());
-                            run_++;
-                            (UNITTEST_PROC(it->ptr))();
-                        }
-                    }
-                    else {
-                        printf("\n[Run] %s\n", it->func.c_str());
-                        run_++;
-                        (UNITTEST_PROC(it->ptr))();
+                    run_graph();
+                }
+                if (round_ == 0) {
+                    for (size_t i = 0; i < nodes_.size(); i++) {
+                        if (!nodes_[i].fi.first) again.push_back(nodes_[i].fi);
                     }
                 }
+                round_++;
+                bool more = round_ < repeat_ || (until && now_ms() < until);
+                if (!more || again.empty()) break;
+                printf("\n[Round] %d\n", round_ + 1);
+                past_ = totals();
+                nodes_.clear();
+                wait_.clear();
+                index_.clear();
+                funcs_ = again;
             }
             printf("--------------------------------------------------\n");
             printf("Unit test end.\n");
             printf("--------------------------------------------------\n");
+            // the reports may fail tests too (soak), the result file has them
+            for (size_t i = 0; i < reports_.size(); i++) {
+                reports_[i]();
+            }
+            if (get_option("--result-file=", path)) {
+                write_results(path);
+            }
+            // a shard only knows its own tests, merge the result files to
+            // get the durations of the whole suite
+            if (shard_count_ <= 1 && get_option("--durations=", path)) {
+                std::vector<test_total> all = totals();
+                for (size_t i = 0; i < all.size(); i++) {
+                    if (all[i].runs > 0) {
+                        durations_[all[i].func] = all[i].ms / all[i].runs;
+                    }
+                }
+                write_durations(path);
+            }
             show_result();
             if (pause_on_exit_) {
                 printf("Press any key to exit...\n");
@@ -149,7 +338,19 @@ namespace vtest
     public:
         void check_eq(bool eq, const char* fn, int ln, const char* fp, int row)
         {
+            ut_alloc_pause quiet;
+            // checks may come from the threads of a stress test
+            std::lock_guard<std::mutex> guard(lock_);
             count_++;
+            test_node* t = current_test();
+            if (t && eq == false) {
+                t->failed++;
+            }
+            if (eq == false) {
+                for (size_t i = 0; i < fail_hooks_.size(); i++) {
+                    fail_hooks_[i](fn, ln);
+                }
+            }
             if (eq == true) {
                 pass_++;
                 ut_cons.set_color_mode_passed();
@@ -157,13 +358,21 @@ namespace vtest
                 ut_cons.reset_color_mode();
             }
             else {
-                ut_cons.set_color_mode_failed();
-                char buf[128];
-                snprintf(buf, 128, "ERROR %s, line %d, case %d, %s\n",
-                    fn, ln, row, get_file_name(fp));
-                printf(buf);
-                ut_cons.reset_color_mode();
-                errs_.push_back(std::string(buf));
+                add_site(fn, fp, ln, row);
+                if (keep_failure(t)) {
+                    ut_cons.set_color_mode_failed();
+                    char buf[128];
+                    snprintf(buf, 128, "ERROR %s, line %d, case %d, %s\n",
+                        fn, ln, row, get_file_name(fp));
+                    printf(buf);
+                    ut_cons.reset_color_mode();
+                    errs_.push_back(std::string(buf));
+                }
+                else {
+                    if (dropped_++ == 0 || (t && t->failed == max_test_errors_ + 1)) {
+                        printf("ERROR %s, more failures are only counted\n", fn);
+                    }
+                }
                 if (exit_on_failed_) {
                     show_result();
                     if (pause_on_exit_) {
@@ -182,24 +391,116 @@ namespace vtest
             if (count_ != pass_) {
                 ut_cons.set_color_mode_failed();
             }
-            printf("Failed %d\n", count_ - pass_);
+            printf("Failed %d", count_ - pass_);
+            if (skip_ > 0) {
+                printf(", Skipped %d", skip_);
+            }
+            printf("\n");
             printf("--------------------------------------------------\n");
             if (report_detail_ && !errs_.empty()) {
                 for (size_t i = 0; i < errs_.size(); i++) {
                     printf(errs_[i].c_str());
                 }
             }
+            if (report_detail_ && dropped_ > 0) {
+                printf("... %d more failures not shown\n", dropped_);
+                show_aggregates();
+            }
             ut_cons.reset_color_mode();
             printf("--------------------------------------------------\n");
         }
-        void add_func(void* ptr, const char* func, bool first = false)
+        // a failed check still fits --max-errors (1000 in the run) and
+        // --max-test-errors (100 in a test), 0 is no limit
+        bool will_report()
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            return keep_failure(current_test(), 1);
+        }
+        // failures of the running test, or of the run outside a test
+        int test_failures()
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            test_node* t = current_test();
+            return t ? t->failed : count_ - pass_;
+        }
+        int batch_limit() const { return batch_limit_; }
+        // rounds of --repeat / --duration done so far
+        int rounds() const { return round_; }
+        bool soak() const { return repeat_ > 1 || duration_ms_ > 0; }
+        static unsigned long long now_ms()
+        {
+            return (unsigned long long)std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+        void add_func(void* ptr, const char* func, bool first = false,
+            const char* file = "", int line = 0)
         {
+            std::lock_guard<std::mutex> guard(lock_);
             if (first) {
-                funcs_.insert(funcs_.begin(), func_info(ptr, func, level_));
+                funcs_.insert(funcs_.begin(), func_info(ptr, func, level_, true, file, line));
             }
             else {
-                funcs_.push_back(func_info(ptr, func, level_));
+                funcs_.push_back(func_info(ptr, func, level_, false, file, line));
+            }
+        }
+        // what a test or a region needs while it runs, the scheduler keeps
+        // the sum of the running tests within --budget-threads (--jobs by
+        // default) and --budget-mem in MB (no limit by default), an
+        // exclusive test runs alone
+        struct resource {
+            int threads;
+            int mem;
+            bool exclusive;
+        };
+        void set_resource(const char* name, bool region, int threads, int mem,
+            bool exclusive)
+        {
+            resource r = { threads > 0 ? threads : 1, mem > 0 ? mem : 0, exclusive };
+            (region ? level_resources_ : resources_)[name] = r;
+        }
+        // checks done by the compiler, counted as passed
+        void add_static_checks(const char* fn, int n)
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            count_ += n;
+            pass_ += n;
+            ut_cons.set_color_mode_passed();
+            printf("PASS %s, %d compile time checks\n", fn, n);
+            ut_cons.reset_color_mode();
+        }
+        // test b runs after test a, and is skipped when a fails
+        void add_depend(const char* b, const char* a)
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            deps_[b].push_back(a);
+        }
+        void set_jobs(int value) { jobs_ = value > 0 ? value : 1; }
+        int jobs() const { return jobs_; }
+        // value of the last "--name=value" argument passed to init()
+        bool get_option(const char* key, std::string& value) const
+        {
+            size_t n = strlen(key);
+            for (size_t i = args_.size(); i > 0; i--) {
+                if (args_[i - 1].compare(0, n, key) == 0) {
+                    value = args_[i - 1].substr(n);
+                    return true;
+                }
+            }
+            return false;
+        }
+        // a flag alone or as flag=value, not a longer flag it prefixes,
+        // value is what follows the = or empty
+        bool get_flag(const char* key, std::string& value) const
+        {
+            size_t n = strlen(key);
+            for (size_t i = args_.size(); i > 0; i--) {
+                const std::string& a = args_[i - 1];
+                if (a.compare(0, n, key) == 0 && (a.size() == n || a[n] == '=')) {
+                    value = a.size() > n ? a.substr(n + 1) : std::string();
+                    return true;
+                }
             }
+            return false;
         }
         void set_level(const char* v)
         {
@@ -228,7 +529,47 @@ namespace vtest
             std::string s;
             for (int i = 1; i < argc; i++) {
                 s = argv[i];
-                if (s.find("-rx") == 0) {
+                args_.push_back(s);
+                if (s.find("--jobs=") == 0) {
+                    set_jobs(atoi(s.c_str() + 7));
+                }
+                else if (s.find("--shard-index=") == 0) {
+                    shard_index_ = atoi(s.c_str() + 14);
+                }
+                else if (s.find("--shard-count=") == 0) {
+                    shard_count_ = atoi(s.c_str() + 14);
+                }
+                else if (s.find("--repeat=") == 0) {
+                    repeat_ = atoi(s.c_str() + 9);
+                }
+                else if (s.find("--duration=") == 0) {
+                    duration_ms_ = parse_duration(s.c_str() + 11);
+                }
+                else if (s == "--shuffle") {
+                    shuffle_ = true;
+                }
+                else if (s.find("--seed=") == 0) {
+                    seed_ = strtoull(s.c_str() + 7, NULL, 10);
+                }
+                else if (s.find("--max-errors=") == 0) {
+                    max_errors_ = atoi(s.c_str() + 13);
+                }
+                else if (s.find("--max-test-errors=") == 0) {
+                    max_test_errors_ = atoi(s.c_str() + 18);
+                }
+                else if (s.find("--batch-max-failures=") == 0) {
+                    batch_limit_ = atoi(s.c_str() + 21);
+                }
+                else if (s.find("--filter=") == 0) {
+                    extract_filters(s.substr(9));
+                }
+                else if (s.find("--scale=") == 0) {
+                    scale_ = atoi(s.c_str() + 8);
+                }
+                else if (s == "--scale") {
+                    scale_ = -1;
+                }
+                else if (s.find("-rx") == 0) {
                     level_check_ = true;
                 }
                 else if (s.find("-rd=") == 0) {
@@ -247,6 +588,29 @@ namespace vtest
             if (!map_run_level_.empty()) {
                 level_filter_ = true;
             }
+            if (shard_index_ < 0 || shard_index_ >= shard_count_) {
+                printf("Invalid shard %d of %d, run all tests\n",
+                    shard_index_, shard_count_);
+                shard_index_ = 0;
+                shard_count_ = 1;
+            }
+        }
+        // 90, 90s, 15m or 2h
+        static unsigned long long parse_duration(const char* s)
+        {
+            char* end;
+            double v = strtod(s, &end);
+            double unit = *end == 'm' ? 60 : *end == 'h' ? 3600 : 1;
+            return v > 0 ? (unsigned long long)(v * unit * 1000) : 0;
+        }
+        // FNV-1a, stable across builds and machines
+        static unsigned long long name_hash(const char* s)
+        {
+            unsigned long long h = 0xcbf29ce484222325ULL;
+            for (; *s; s++) {
+                h = (h ^ (unsigned char)*s) * 0x100000001b3ULL;
+            }
+            return h;
         }
         const char* get_file_name(const char* fname)
         {
@@ -272,126 +636,1080 @@ namespace vtest
             report_detail_ = true;
             level_filter_ = false;
             level_check_ = false;
+            skip_ = 0;
+            jobs_ = 1;
+            dropped_ = 0;
+            max_errors_ = 1000;
+            max_test_errors_ = 100;
+            batch_limit_ = 0;
+            repeat_ = 1;
+            round_ = 0;
+            duration_ms_ = 0;
+            shuffle_ = false;
+            seed_ = (unsigned long long)time(NULL);
+            const char* env = getenv("VTEST_SHARD_INDEX");
+            shard_index_ = env ? atoi(env) : 0;
+            env = getenv("VTEST_SHARD_COUNT");
+            shard_count_ = env ? atoi(env) : 1;
+            shard_planned_ = false;
+            running_ = 0;
+            fixtures_ = 0;
+            parked_ = 0;
+            looping_ = false;
+            order_low_ = 0;
+            order_high_ = 0;
+            budget_threads_ = 1;
+            budget_mem_ = 0;
+            used_threads_ = 0;
+            used_mem_ = 0;
+            exclusive_ = false;
+            scale_ = 0;
+            async_runner_ = NULL;
             level_ = "__root__";
         }
         struct func_info {
             void* ptr;
             std::string func;
             std::string level;
-            func_info(void* p, std::string c, std::string l)
-                : ptr(p), func(c), level(l)
+            bool first;
+            // where the test is defined, for the failures reported about it
+            const char* file;
+            int line;
+            func_info(void* p, std::string c, std::string l, bool f = false,
+                const char* fp = "", int ln = 0)
+                : ptr(p), func(c), level(l), first(f), file(fp), line(ln)
             {}
         };
-        void extract_levels(const std::string& str, int state)
+        enum { NODE_WAIT, NODE_RUNNING, NODE_DONE, NODE_FAILED, NODE_SKIPPED };
+    public:
+        // a test scheduled by run_all(), the graph edges come from deps_
+        struct test_node {
+            func_info fi;
+            int order;
+            int state;
+            int failed;
+            double ms;
+            resource res;
+            // async roots of the test still on the loop, the test is done
+            // when the last one finishes, parked once its function returned
+            int pending;
+            bool parked;
+            // the live allocations made by the test over all its rounds
+            std::atomic<long long>* allocs;
+            test_node(const func_info& f, int o)
+                : fi(f), order(o), state(NODE_WAIT), failed(0), ms(0),
+                pending(0), parked(false), allocs(NULL)
+            {
+                res.threads = 1;
+                res.mem = 0;
+                res.exclusive = false;
+            }
+        };
+        // called on the test thread before (begin) and after each test
+        typedef void(*TEST_HOOK)(test_node& t, bool begin);
+        void add_hook(TEST_HOOK hook) { hooks_.push_back(hook); }
+        // called on every failed check
+        typedef void(*FAIL_HOOK)(const char* fn, int line);
+        void add_fail_hook(FAIL_HOOK hook) { fail_hooks_.push_back(hook); }
+        // called once after the run, before the totals
+        typedef void(*REPORT_HOOK)(void);
+        void add_report(REPORT_HOOK report) { reports_.push_back(report); }
+        // the test running on this thread, stress threads inherit it
+        static test_node*& current_test()
         {
-            std::string v;
-            for (size_t i = 0; i < str.length(); i++) {
-                if (str.at(i) == ',') {
-                    if (v.size() > 0) {
-                        map_run_level_[v] = state;
-                    }
-                    v = "";
-                }
-                else {
-                    if (str.at(i) == 0) return;
-                    v += str.at(i);
+            static thread_local test_node* obj_ = NULL;
+            return obj_;
+        }
+        // an async root spawned by the test, it keeps the test running
+        void hold_test(test_node* t)
+        {
+            std::lock_guard<std::mutex> guard(sched_lock_);
+            t->pending++;
+        }
+        // called by the loop when a root of the test has finished
+        void async_done(test_node* t, double ms)
+        {
+            {
+                std::lock_guard<std::mutex> guard(sched_lock_);
+                if (ms > t->ms) t->ms = ms;
+                if (--t->pending > 0 || !t->parked) return;
+            }
+            end_test(*t);
+        }
+    private:
+        bool should_run(const func_info& fi)
+        {
+            if (!level_filter_) return true;
+            std::map<std::string, int>::iterator it = map_run_level_.find(fi.level);
+            if (level_check_) {
+                return it != map_run_level_.end() && it->second == 1;
+            }
+            return it == map_run_level_.end() || it->second == 1;
+        }
+        // move the registered tests into the graph, VTEST_TOP_ADD ones go
+        // before everything still waiting, the others after it
+        void absorb()
+        {
+            std::vector<func_info> funcs;
+            {
+                std::lock_guard<std::mutex> guard(lock_);
+                funcs.swap(funcs_);
+            }
+            if (!shard_planned_) {
+                plan_shards(funcs);
+            }
+            int first = 0;
+            for (size_t i = 0; i < funcs.size(); i++) {
+                if (funcs[i].first) first++;
+            }
+            order_low_ -= first;
+            int low = order_low_;
+            // in parallel runs the tests with recorded durations start
+            // longest first, the others keep their place after them
+            std::vector<std::pair<double, size_t> > by_time;
+            for (size_t i = 0; i < funcs.size(); i++) {
+                std::map<std::string, double>::iterator d = durations_.find(funcs[i].func);
+                double ms = jobs_ > 1 && d != durations_.end() ? d->second : 0;
+                by_time.push_back(std::make_pair(-ms, i));
+            }
+            std::stable_sort(by_time.begin(), by_time.end());
+            // --shuffle orders each batch by --seed and the round instead
+            if (shuffle_) {
+                unsigned long long s = seed_ + round_ * 0x9e3779b97f4a7c15ULL, z;
+                for (size_t i = by_time.size(); i > 1; i--) {
+                    s += 0x9e3779b97f4a7c15ULL;
+                    z = (s ^ (s >> 30)) * 0xbf58476d1ce4e5b9ULL;
+                    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+                    std::swap(by_time[i - 1], by_time[(size_t)((z ^ (z >> 31)) % i)]);
                 }
             }
-            if (v.size() > 0) {
-                map_run_level_[v] = state;
+            std::vector<int> rank(funcs.size());
+            for (size_t i = 0; i < by_time.size(); i++) {
+                rank[by_time[i].second] = (int)i;
+            }
+            int high = order_high_;
+            order_high_ += (int)funcs.size();
+            for (size_t i = 0; i < funcs.size(); i++) {
+                known_.insert(funcs[i].func);
+                // every shard runs the fixtures, its tests need them
+                if (!should_run(funcs[i]) || !in_filter(funcs[i].func)
+                    || (!funcs[i].first && !in_shard(funcs[i].func))) continue;
+                int order = funcs[i].first ? low++ : high + rank[i];
+                nodes_.push_back(test_node(funcs[i], order));
+                nodes_.back().res = find_resource(funcs[i]);
+                nodes_.back().allocs = &allocs_[funcs[i].func];
+                if (funcs[i].first) fixtures_++;
+                wait_.insert(std::make_pair(order, nodes_.size() - 1));
+                if (index_.find(funcs[i].func) == index_.end()) {
+                    index_[funcs[i].func] = nodes_.size() - 1;
+                }
             }
         }
-    private:
-        int run_;
-        int count_;
-        int pass_;
-        bool exit_on_failed_;
-        bool pause_on_exit_;
-        bool report_detail_;
-        bool level_filter_;
-        bool level_check_;
-        std::string level_;
-        std::vector<func_info> funcs_;
-        std::vector<std::string> errs_;
-        std::map<std::string, int> map_run_level_;
-        std::map<std::string, int>::iterator map_it_;
-    };
-    static unit_test& ut_test = unit_test::instance();
-
-    class ut_func_holder
-    {
-    public:
-        ut_func_holder(void* ptr, const char* func, bool first = false)
+        // next is 1 before check_eq counted the failure for the test, the
+        // run wide list has not stored it yet either way
+        bool keep_failure(test_node* t, int next = 0)
         {
-            ut_test.add_func(ptr, func, first);
+            if (max_errors_ > 0 && (int)errs_.size() >= max_errors_) return false;
+            return t == NULL || max_test_errors_ <= 0 || t->failed + next <= max_test_errors_;
         }
-    };
-
-    class ut_level_holder
-    {
-    public:
-        ut_level_holder(const char* level)
+        // one per assertion line, the failing rows as merged ranges
+        struct fail_site
         {
-            ut_test.set_level(level);
+            std::string fn;
+            int count;
+            bool more_rows;
+            std::vector<std::pair<int, int> > rows;
+        };
+        void add_site(const char* fn, const char* fp, int ln, int row)
+        {
+            fail_site& s = sites_[std::make_pair(std::string(get_file_name(fp)), ln)];
+            if (s.count++ == 0) {
+                s.fn = fn;
+                s.more_rows = false;
+            }
+            if (!s.rows.empty() && row >= s.rows.back().first
+                && row <= s.rows.back().second + 1) {
+                if (row > s.rows.back().second) s.rows.back().second = row;
+            }
+            else if (s.rows.size() < 8) {
+                s.rows.push_back(std::make_pair(row, row));
+            }
+            else {
+                s.more_rows = true;
+            }
         }
-    };
-
-#ifdef _MSC_VER
-    typedef __int8            ut_i8;
-    typedef __int16           ut_i16;
-    typedef __int32           ut_i32;
-    typedef __int64           ut_i64;
-    typedef unsigned __int8   ut_u8;
-    typedef unsigned __int16  ut_u16;
-    typedef unsigned __int32  ut_u32;
-    typedef unsigned __int64  ut_u64;
-#else
-    typedef signed char    ut_i8;
-    typedef short          ut_i16;
-    typedef int            ut_i32;
-    typedef long           ut_i64;
-    typedef unsigned char  ut_u8;
-    typedef unsigned short ut_u16;
-    typedef unsigned int   ut_u32;
-    typedef unsigned long  ut_u64;
-#endif
-
-    class ut_var
-    {
-    public:
-        ut_var(const bool v) { init(); t_ = UTD_BOOL; v_.b = v; }
-        ut_var(const ut_i8 v) { init(); t_ = UTD_CHAR; v_.c = v; }
-        ut_var(const ut_i16 v) { init(); t_ = UTD_SHORT; v_.s = v; }
-        ut_var(const ut_i32 v) { init(); t_ = UTD_INT; v_.i = v; }
-        ut_var(const ut_i64 v) { init(); t_ = UTD_INT64; v_.l = v; }
-        ut_var(const ut_u8 v) { init(); t_ = UTD_UCHAR; v_.c = v; }
-        ut_var(const ut_u16 v) { init(); t_ = UTD_USHORT; v_.s = v; }
-        ut_var(const ut_u32 v) { init(); t_ = UTD_UINT; v_.i = v; }
-        ut_var(const ut_u64 v) { init(); t_ = UTD_UINT64; v_.l = v; }
-        ut_var(const float v) { init(); t_ = UTD_FLOAT; v_.f = v; }
-        ut_var(const double v) { init(); t_ = UTD_DOUBLE; v_.r = v; }
-        ut_var(const char* v) { init(); t_ = UTD_STR; s_ = std::string(v); }
-        ut_var(const wchar_t* v) { init(); t_ = UTD_WSTR; ws_ = std::wstring(v); }
-        ut_var(const std::string& v) { init(); t_ = UTD_STR; s_ = v; }
-        ut_var(const std::wstring& v) { init();t_ = UTD_WSTR;  ws_ = v; }
-        ut_var() { init(); }
-        ut_var(const ut_var& other)
+        // a test over the rounds of --repeat, the time of the rounds it
+        // ran in, failed if any of them failed
+        struct test_total
         {
-            this->t_ = other.t_;
-            this->s_ = other.s_;
-            this->ws_ = other.ws_;
-            memcpy(&this->v_, &other.v_, 8);
+            std::string func;
+            double ms;
+            int runs;
+            int failed;
+            int state;
+        };
+        static int state_rank(int state)
+        {
+            return state == NODE_FAILED ? 3 : state == NODE_DONE ? 2
+                : state == NODE_SKIPPED ? 1 : 0;
         }
-        ut_var& operator=(const ut_var& other)
+        // past_ with the nodes of the round so far, in the order they came
+        std::vector<test_total> totals()
         {
-            this->t_ = other.t_;
-            this->s_ = other.s_;
-            this->ws_ = other.ws_;
-            memcpy(&this->v_, &other.v_, 8);
-            return (*this);
+            std::vector<test_total> all = past_;
+            std::map<std::string, size_t> at;
+            for (size_t i = 0; i < all.size(); i++) {
+                at[all[i].func] = i;
+            }
+            for (size_t i = 0; i < nodes_.size(); i++) {
+                const test_node& n = nodes_[i];
+                std::map<std::string, size_t>::iterator it = at.find(n.fi.func);
+                if (it == at.end()) {
+                    test_total z = { n.fi.func, 0, 0, 0, n.state };
+                    it = at.insert(std::make_pair(n.fi.func, all.size())).first;
+                    all.push_back(z);
+                }
+                test_total& x = all[it->second];
+                if (n.state != NODE_SKIPPED) {
+                    x.ms += n.ms;
+                    x.runs++;
+                }
+                x.failed += n.failed;
+                if (state_rank(n.state) > state_rank(x.state)) x.state = n.state;
+            }
+            return all;
         }
-        operator const char*() const { return s_.c_str(); }
-        operator const wchar_t*() const { return ws_.c_str(); }
+        void show_aggregates()
+        {
+            printf("Failures by test:\n");
+            std::vector<test_total> all = totals();
+            for (size_t i = 0; i < all.size(); i++) {
+                if (all[i].failed > 0) {
+                    printf("  %-32s %d\n", all[i].func.c_str(), all[i].failed);
+                }
+            }
+            printf("Failures by site:\n");
+            std::map<std::pair<std::string, int>, fail_site>::iterator it;
+            for (it = sites_.begin(); it != sites_.end(); it++) {
+                const fail_site& s = it->second;
+                printf("  %s:%d %s, %d failures, cases", it->first.first.c_str(),
+                    it->first.second, s.fn.c_str(), s.count);
+                for (size_t k = 0; k < s.rows.size(); k++) {
+                    if (s.rows[k].first == s.rows[k].second) {
+                        printf(" %d", s.rows[k].first);
+                    }
+                    else {
+                        printf(" %d-%d", s.rows[k].first, s.rows[k].second);
+                    }
+                }
+                printf("%s\n", s.more_rows ? " ..." : "");
+            }
+        }
+        resource find_resource(const func_info& fi)
+        {
+            std::map<std::string, resource>::iterator it = resources_.find(fi.func);
+            if (it != resources_.end()) return it->second;
+            it = level_resources_.find(fi.level);
+            if (it != level_resources_.end()) return it->second;
+            resource r = { 1, 0, false };
+            return r;
+        }
+        // the need of a test clamped to the budget, so it can run alone
+        void need(const test_node& t, int& threads, int& mem)
+        {
+            threads = t.res.exclusive ? budget_threads_ : t.res.threads;
+            if (threads > budget_threads_) threads = budget_threads_;
+            mem = t.res.exclusive || (budget_mem_ && t.res.mem > budget_mem_)
+                ? budget_mem_ : t.res.mem;
+        }
+        void extract_filters(const std::string& s)
+        {
+            size_t pos = 0;
+            while (pos <= s.size()) {
+                size_t end = s.find(',', pos);
+                if (end == std::string::npos) end = s.size();
+                if (end > pos) filters_.push_back(s.substr(pos, end - pos));
+                pos = end + 1;
+            }
+        }
+        // --filter=t_a*,t_b runs the tests matching any of the globs
+        bool in_filter(const std::string& name)
+        {
+            if (filters_.empty()) return true;
+            for (size_t i = 0; i < filters_.size(); i++) {
+                if (ut_glob_match(filters_[i].c_str(), name.c_str())) return true;
+            }
+            return false;
+        }
+        bool in_shard(const std::string& name)
+        {
+            if (shard_count_ <= 1) return true;
+            std::map<std::string, int>::iterator it = shard_of_.find(name);
+            if (it != shard_of_.end()) return it->second == shard_index_;
+            return (int)(name_hash(name.c_str()) % shard_count_) == shard_index_;
+        }
+        // with recorded durations the tests registered before the run are
+        // split longest first onto the least loaded shard, every shard
+        // computes the same plan. tests added later or without durations
+        // are split by name hash, dependencies across shards are ignored
+        void plan_shards(const std::vector<func_info>& funcs)
+        {
+            shard_planned_ = true;
+            if (shard_count_ <= 1 || durations_.empty()) return;
+            std::vector<std::pair<double, std::string> > jobs;
+            for (size_t i = 0; i < funcs.size(); i++) {
+                std::map<std::string, double>::iterator it
+                    = durations_.find(funcs[i].func);
+                if (it != durations_.end() && should_run(funcs[i]) && !funcs[i].first) {
+                    jobs.push_back(std::make_pair(-it->second, funcs[i].func));
+                }
+            }
+            std::sort(jobs.begin(), jobs.end());
+            std::vector<double> load(shard_count_, 0);
+            for (size_t i = 0; i < jobs.size(); i++) {
+                int best = 0;
+                for (int k = 1; k < shard_count_; k++) {
+                    if (load[k] < load[best]) best = k;
+                }
+                load[best] -= jobs[i].first;
+                shard_of_[jobs[i].second] = best;
+            }
+        }
+        void read_durations(const std::string& path)
+        {
+            FILE* fp = fopen(path.c_str(), "r");
+            if (fp == NULL) return;
+            char name[512];
+            double ms;
+            while (fscanf(fp, "%511s %lf", name, &ms) == 2) {
+                durations_[name] = ms;
+            }
+            fclose(fp);
+        }
+        void write_durations(const std::string& path)
+        {
+            FILE* fp = fopen(path.c_str(), "w");
+            if (fp == NULL) return;
+            std::map<std::string, double>::iterator it;
+            for (it = durations_.begin(); it != durations_.end(); it++) {
+                fprintf(fp, "%s %.3f\n", it->first.c_str(), it->second);
+            }
+            fclose(fp);
+        }
+        // plain text, one record per line, see merge_results()
+        void write_results(const std::string& path)
+        {
+            FILE* fp = fopen(path.c_str(), "w");
+            if (fp == NULL) {
+                printf("Can not write result file %s\n", path.c_str());
+                return;
+            }
+            fprintf(fp, "vtest-result 1\n");
+            fprintf(fp, "run %d\ncount %d\npass %d\nskip %d\n",
+                run_, count_, pass_, skip_);
+            // one line per test, the mean time of the rounds it ran in
+            std::vector<test_total> all = totals();
+            for (size_t i = 0; i < all.size(); i++) {
+                static const char* st[] = { "wait", "run", "pass", "fail", "skip" };
+                fprintf(fp, "test %s %.3f %s\n", all[i].func.c_str(),
+                    all[i].runs ? all[i].ms / all[i].runs : 0, st[all[i].state]);
+            }
+            for (size_t i = 0; i < errs_.size(); i++) {
+                fprintf(fp, "err %s", errs_[i].c_str());
+            }
+            fclose(fp);
+        }
+        // --merge=a.txt,b.txt sums the result files of the shards into one
+        // report, the durations of all shards go to --durations=
+        int merge_results(const std::string& files)
+        {
+            std::string path;
+            size_t pos = 0;
+            int missing = 0;
+            while (pos <= files.size()) {
+                size_t end = files.find(',', pos);
+                if (end == std::string::npos) end = files.size();
+                path = files.substr(pos, end - pos);
+                pos = end + 1;
+                if (path.empty()) continue;
+                if (!read_results(path)) {
+                    printf("Can not read result file %s\n", path.c_str());
+                    missing++;
+                }
+            }
+            if (get_option("--durations=", path)) {
+                write_durations(path);
+            }
+            show_result();
+            return count_ - pass_ + missing;
+        }
+        bool read_results(const std::string& path)
+        {
+            FILE* fp = fopen(path.c_str(), "r");
+            if (fp == NULL) return false;
+            char line[1024], name[512], st[16];
+            double ms;
+            int v;
+            bool ok = fgets(line, sizeof(line), fp) != NULL
+                && strncmp(line, "vtest-result 1", 14) == 0;
+            while (ok && fgets(line, sizeof(line), fp)) {
+                if (strncmp(line, "err ", 4) == 0) {
+                    errs_.push_back(line + 4);
+                }
+                else if (sscanf(line, "test %511s %lf %15s", name, &ms, st) == 3) {
+                    if (strcmp(st, "skip") != 0) durations_[name] = ms;
+                }
+                else if (sscanf(line, "run %d", &v) == 1) run_ += v;
+                else if (sscanf(line, "count %d", &v) == 1) count_ += v;
+                else if (sscanf(line, "pass %d", &v) == 1) pass_ += v;
+                else if (sscanf(line, "skip %d", &v) == 1) skip_ += v;
+            }
+            fclose(fp);
+            return ok;
+        }
+#ifdef VTEST_HAS_SERVE
+        // the VTEST_TOP_ADD fixtures run once here, every request then forks
+        // from this warm process and runs the other tests with its own
+        // options. a request is the arguments one per line ended by an
+        // empty line, the reply is the output of the child ended with a
+        // "vtest-exit <code>" line. a request of --quit stops the server
+        int serve(const std::string& path)
+        {
+            std::vector<func_info> rest;
+            for (size_t i = 0; i < funcs_.size(); i++) {
+                if (!funcs_[i].first) rest.push_back(funcs_[i]);
+            }
+            funcs_.erase(std::remove_if(funcs_.begin(), funcs_.end(), not_first),
+                funcs_.end());
+            while (!funcs_.empty()) {
+                run_graph();
+            }
+            int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            struct sockaddr_un addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sun_family = AF_UNIX;
+            strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+            unlink(addr.sun_path);
+            if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0
+                || listen(fd, 16) != 0) {
+                printf("Can not serve on %s\n", path.c_str());
+                if (fd >= 0) close(fd);
+                return -1;
+            }
+            signal(SIGPIPE, SIG_IGN);
+            printf("Serving %d tests on %s\n", (int)rest.size(), path.c_str());
+            fflush(stdout);
+            for (;;) {
+                int c = accept(fd, NULL, NULL);
+                if (c < 0) {
+                    if (errno == EINTR) continue;
+                    break;
+                }
+                std::vector<std::string> args;
+                if (!read_request(c, args)) {
+                    close(c);
+                    continue;
+                }
+                if (args.size() == 1 && args[0] == "--quit") {
+                    send_all(c, "vtest-exit 0\n");
+                    close(c);
+                    break;
+                }
+                fflush(stdout);
+                // the child tells through the pipe that it sent its exit
+                // line, one leaving by exit() on the way did not
+                int sent[2];
+                if (pipe(sent) != 0) sent[0] = sent[1] = -1;
+                pid_t pid = fork();
+                if (pid == 0) {
+                    close(fd);
+                    if (sent[0] >= 0) close(sent[0]);
+                    dup2(c, 1);
+                    dup2(c, 2);
+                    close(c);
+                    setvbuf(stdout, NULL, _IOLBF, 0);
+                    reset_run();
+                    std::vector<char*> argv(1, (char*)"vtest");
+                    for (size_t i = 0; i < args.size(); i++) {
+                        if (args[i].find("--serve") == 0 || args[i].find("--client") == 0) continue;
+                        argv.push_back((char*)args[i].c_str());
+                    }
+                    init((int)argv.size(), &argv[0]);
+                    funcs_ = rest;
+                    int code = run_all();
+                    printf("vtest-exit %d\n", code);
+                    fflush(stdout);
+                    if (sent[1] >= 0 && write(sent[1], "1", 1) < 0) {}
+                    _exit(0);
+                }
+                if (sent[1] >= 0) close(sent[1]);
+                int status = 0;
+                if (pid > 0) {
+                    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+                }
+                char buf[96];
+                if (pid < 0 || !WIFEXITED(status)) {
+                    snprintf(buf, sizeof(buf), "[Crash] test process %s %d\nvtest-exit -1\n",
+                        pid < 0 ? "fork failed" : "killed by signal",
+                        pid < 0 ? errno : WTERMSIG(status));
+                    send_all(c, buf);
+                }
+                else if (sent[0] >= 0 && read(sent[0], buf, 1) != 1) {
+                    snprintf(buf, sizeof(buf), "vtest-exit %d\n", WEXITSTATUS(status));
+                    send_all(c, buf);
+                }
+                if (sent[0] >= 0) close(sent[0]);
+                close(c);
+            }
+            close(fd);
+            unlink(addr.sun_path);
+            return 0;
+        }
+        // --client=path sends the other arguments to a --serve process and
+        // prints its output, the exit code is the one of the remote run
+        int client(const std::string& path)
+        {
+            int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            struct sockaddr_un addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sun_family = AF_UNIX;
+            strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+            if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+                printf("Can not connect to %s\n", path.c_str());
+                if (fd >= 0) close(fd);
+                return -1;
+            }
+            std::string req;
+            for (size_t i = 0; i < args_.size(); i++) {
+                if (args_[i].find("--client=") == 0) continue;
+                req += args_[i] + "\n";
+            }
+            send_all(fd, req + "\n");
+            std::string pending;
+            char buf[4096];
+            int code = -1;
+            ssize_t n;
+            while ((n = read(fd, buf, sizeof(buf))) != 0) {
+                if (n < 0) {
+                    if (errno == EINTR) continue;
+                    break;
+                }
+                pending.append(buf, n);
+                size_t pos = 0, nl;
+                while ((nl = pending.find('\n', pos)) != std::string::npos) {
+                    if (pending.compare(pos, 11, "vtest-exit ") == 0) {
+                        code = atoi(pending.c_str() + pos + 11);
+                    }
+                    else {
+                        fwrite(pending.data() + pos, 1, nl + 1 - pos, stdout);
+                    }
+                    pos = nl + 1;
+                }
+                pending.erase(0, pos);
+                fflush(stdout);
+            }
+            fwrite(pending.data(), 1, pending.size(), stdout);
+            close(fd);
+            return code;
+        }
+        static bool not_first(const func_info& fi) { return !fi.first; }
+        static bool send_all(int fd, const std::string& s)
+        {
+            size_t off = 0;
+            while (off < s.size()) {
+                ssize_t n = write(fd, s.data() + off, s.size() - off);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) return false;
+                off += n;
+            }
+            return true;
+        }
+        static bool read_request(int fd, std::vector<std::string>& args)
+        {
+            std::string req;
+            char buf[1024];
+            while (req.size() < 65536) {
+                ssize_t n = read(fd, buf, sizeof(buf));
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) return false;
+                req.append(buf, n);
+                size_t end = req.find("\n\n");
+                if (end == std::string::npos && req == "\n") end = 0;
+                if (end != std::string::npos) {
+                    size_t pos = 0, nl;
+                    while ((nl = req.find('\n', pos)) != std::string::npos && pos < end + 1) {
+                        if (nl > pos) args.push_back(req.substr(pos, nl - pos));
+                        pos = nl + 1;
+                    }
+                    return true;
+                }
+            }
+            return false;
+        }
+        // the options and results of a run, before a served request
+        void reset_run()
+        {
+            run_ = 0;
+            count_ = 0;
+            pass_ = 0;
+            skip_ = 0;
+            exit_on_failed_ = false;
+            pause_on_exit_ = false;
+            level_filter_ = false;
+            level_check_ = false;
+            jobs_ = 1;
+            scale_ = 0;
+            shard_index_ = 0;
+            shard_count_ = 1;
+            shard_planned_ = false;
+            order_low_ = 0;
+            order_high_ = 0;
+            errs_.clear();
+            sites_.clear();
+            dropped_ = 0;
+            max_errors_ = 1000;
+            max_test_errors_ = 100;
+            batch_limit_ = 0;
+            repeat_ = 1;
+            round_ = 0;
+            duration_ms_ = 0;
+            shuffle_ = false;
+            map_run_level_.clear();
+            nodes_.clear();
+            past_.clear();
+            known_.clear();
+            missing_.clear();
+            wait_.clear();
+            index_.clear();
+            args_.clear();
+            filters_.clear();
+            durations_.clear();
+            shard_of_.clear();
+        }
+#endif
+        // the first waiting test in order whose dependencies are done,
+        // dependents of failed or skipped tests are skipped on the way
+        // the VTEST_TOP_ADD fixtures are a barrier, no other test starts
+        // before all of them have finished
+        // a ready test that does not fit the budget reserves what it needs,
+        // later tests may only start in what is left beyond that, so the
+        // big ones are not starved by a stream of small ones
+        // a dependency outside the graph is not waited for, a filtered or
+        // other shard one is a warning and a name no test has is an error
+        // of the dependent test, once each
+        void missing_depend(test_node& t, const std::string& dep)
+        {
+            if (!missing_.insert(std::make_pair(t.fi.func, dep)).second) return;
+            ut_cons.set_color_mode_tip();
+            if (known_.count(dep)) {
+                printf("\n[Depend] %s runs without %s, it is not in this run\n",
+                    t.fi.func.c_str(), dep.c_str());
+                ut_cons.reset_color_mode();
+                return;
+            }
+            printf("Expect: %s depends on a test, Return Value: no test %s\n",
+                t.fi.func.c_str(), dep.c_str());
+            ut_cons.reset_color_mode();
+            // the failure counts for the test, it has not started yet
+            test_node* cur = current_test();
+            current_test() = &t;
+            check_eq(false, t.fi.func.c_str(), t.fi.line, t.fi.file, 0);
+            current_test() = cur;
+        }
+        int pick()
+        {
+            int free_threads = budget_threads_ - used_threads_;
+            int free_mem = budget_mem_ - used_mem_;
+            std::set<std::pair<int, size_t> >::iterator it = wait_.begin();
+            while (it != wait_.end()) {
+                test_node& t = nodes_[it->second];
+                if (fixtures_ > 0 && !t.fi.first) break;
+                int st = NODE_DONE;
+                const std::vector<std::string>& deps = deps_[t.fi.func];
+                for (size_t i = 0; i < deps.size() && st != NODE_SKIPPED; i++) {
+                    std::map<std::string, size_t>::iterator d = index_.find(deps[i]);
+                    if (d == index_.end()) {
+                        missing_depend(t, deps[i]);
+                        continue;
+                    }
+                    int ds = nodes_[d->second].state;
+                    if (ds == NODE_FAILED || ds == NODE_SKIPPED) {
+                        printf("\n[Skip] %s, %s %s\n", t.fi.func.c_str(),
+                            deps[i].c_str(), ds == NODE_FAILED ? "failed" : "skipped");
+                        st = NODE_SKIPPED;
+                    }
+                    else if (ds != NODE_DONE) {
+                        st = NODE_WAIT;
+                    }
+                }
+                if (st == NODE_WAIT) {
+                    it++;
+                    continue;
+                }
+                int threads, mem;
+                need(t, threads, mem);
+                if (st == NODE_DONE && (exclusive_ || threads > free_threads
+                    || (budget_mem_ && mem > free_mem))) {
+                    free_threads -= threads;
+                    free_mem -= mem;
+                    it++;
+                    continue;
+                }
+                size_t i = it->second;
+                wait_.erase(it);
+                if (st == NODE_SKIPPED) {
+                    t.state = NODE_SKIPPED;
+                    skip_++;
+                    if (t.fi.first) fixtures_--;
+                    // a skipped test may be the dependency of an earlier one
+                    it = wait_.begin();
+                    free_threads = budget_threads_ - used_threads_;
+                    free_mem = budget_mem_ - used_mem_;
+                    continue;
+                }
+                used_threads_ += threads;
+                used_mem_ += mem;
+                exclusive_ = t.res.exclusive;
+                return (int)i;
+            }
+            return -1;
+        }
+        // run the graph on jobs_ threads, independent tests run together
+        void run_graph()
+        {
+            std::string v;
+            budget_threads_ = get_option("--budget-threads=", v) ? atoi(v.c_str()) : jobs_;
+            budget_mem_ = get_option("--budget-mem=", v) ? atoi(v.c_str()) : 0;
+            if (budget_threads_ < 1) budget_threads_ = 1;
+            if (budget_mem_ < 0) budget_mem_ = 0;
+            std::vector<std::thread> pool;
+            for (int i = 1; i < jobs_; i++) {
+                pool.push_back(std::thread(&unit_test::work, this));
+            }
+            work();
+            for (size_t i = 0; i < pool.size(); i++) {
+                pool[i].join();
+            }
+        }
+        void work()
+        {
+            typedef void(*UNITTEST_PROC)(void);
+            // the scheduler's own allocations are not the tests', only the
+            // bodies count
+            ut_alloc_pause pause;
+            std::unique_lock<std::mutex> guard(sched_lock_);
+            while (true) {
+                absorb();
+                int i = pick();
+                if (i >= 0) {
+                    test_node& t = nodes_[i];
+                    t.state = NODE_RUNNING;
+                    running_++;
+                    guard.unlock();
+                    printf("\n[Run] %s\n", t.fi.func.c_str());
+                    {
+                        std::lock_guard<std::mutex> g(lock_);
+                        run_++;
+                    }
+                    current_test() = &t;
+                    for (size_t k = 0; k < hooks_.size(); k++) {
+                        hooks_[k](t, true);
+                    }
+                    std::chrono::steady_clock::time_point t0
+                        = std::chrono::steady_clock::now();
+                    int quiet = ut_alloc_quiet();
+                    ut_alloc_quiet() = 0;
+                    (UNITTEST_PROC(t.fi.ptr))();
+                    ut_alloc_quiet() = quiet;
+                    double ms = std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - t0).count();
+                    current_test() = NULL;
+                    guard.lock();
+                    if (ms > t.ms) t.ms = ms;
+                    // an async test goes on in the loop, it gives back its
+                    // resources now and ends when its root does
+                    t.parked = t.pending > 0;
+                    if (t.parked) parked_++;
+                    else {
+                        guard.unlock();
+                        end_test(t);
+                        guard.lock();
+                    }
+                    int threads, mem;
+                    need(t, threads, mem);
+                    used_threads_ -= threads;
+                    used_mem_ -= mem;
+                    if (t.res.exclusive) exclusive_ = false;
+                    running_--;
+                    sched_cond_.notify_all();
+                }
+                else if (parked_ > 0 && !looping_ && async_runner_) {
+                    // an idle worker drives the loop until a root finishes
+                    looping_ = true;
+                    guard.unlock();
+                    async_runner_();
+                    guard.lock();
+                    looping_ = false;
+                    sched_cond_.notify_all();
+                }
+                else if (running_ == 0 && parked_ == 0) {
+                    // only a dependency cycle can leave tests waiting here
+                    std::set<std::pair<int, size_t> >::iterator it;
+                    for (it = wait_.begin(); it != wait_.end(); it++) {
+                        printf("\n[Skip] %s, dependency cycle\n",
+                            nodes_[it->second].fi.func.c_str());
+                        nodes_[it->second].state = NODE_SKIPPED;
+                        skip_++;
+                    }
+                    wait_.clear();
+                    fixtures_ = 0;
+                    sched_cond_.notify_all();
+                    break;
+                }
+                else {
+                    sched_cond_.wait(guard);
+                }
+            }
+        }
+        // the end hooks and the final state of a test, on the worker for
+        // the tests, on the loop thread for the parked async ones
+        void end_test(test_node& t)
+        {
+            ut_alloc_pause quiet;
+            test_node* prev = current_test();
+            current_test() = &t;
+            for (size_t k = hooks_.size(); k > 0; k--) {
+                hooks_[k - 1](t, false);
+            }
+            current_test() = prev;
+            int failed;
+            {
+                std::lock_guard<std::mutex> g(lock_);
+                failed = t.failed;
+            }
+            std::lock_guard<std::mutex> guard(sched_lock_);
+            t.state = failed ? NODE_FAILED : NODE_DONE;
+            if (t.fi.first) fixtures_--;
+            if (t.parked) parked_--;
+            sched_cond_.notify_all();
+        }
+        void extract_levels(const std::string& str, int state)
+        {
+            std::string v;
+            for (size_t i = 0; i < str.length(); i++) {
+                if (str.at(i) == ',') {
+                    if (v.size() > 0) {
+                        map_run_level_[v] = state;
+                    }
+                    v = "";
+                }
+                else {
+                    if (str.at(i) == 0) return;
+                    v += str.at(i);
+                }
+            }
+            if (v.size() > 0) {
+                map_run_level_[v] = state;
+            }
+        }
+    private:
+        int run_;
+        int count_;
+        int pass_;
+        bool exit_on_failed_;
+        bool pause_on_exit_;
+        bool report_detail_;
+        bool level_filter_;
+        bool level_check_;
+        int skip_;
+        int jobs_;
+        int dropped_;
+        int max_errors_;
+        int max_test_errors_;
+        int batch_limit_;
+        int repeat_;
+        int round_;
+        unsigned long long duration_ms_;
+        bool shuffle_;
+        unsigned long long seed_;
+        int shard_index_;
+        int shard_count_;
+        bool shard_planned_;
+        int running_;
+        int fixtures_;
+        int parked_;
+        bool looping_;
+        int order_low_;
+        int order_high_;
+        int budget_threads_;
+        int budget_mem_;
+        int used_threads_;
+        int used_mem_;
+        bool exclusive_;
+        int scale_;
+        void(*async_runner_)(void);
+        std::string level_;
+        std::vector<func_info> funcs_;
+        std::vector<std::string> errs_;
+        std::map<std::string, int> map_run_level_;
+        std::map<std::string, std::vector<std::string> > deps_;
+        // every test absorbed, run or not, and the missing dependencies told
+        std::set<std::string> known_;
+        std::set<std::pair<std::string, std::string> > missing_;
+        std::deque<test_node> nodes_;
+        // never cleared, a block may be freed after the run that made it
+        std::map<std::string, std::atomic<long long> > allocs_;
+        std::vector<test_total> past_;
+        std::set<std::pair<int, size_t> > wait_;
+        std::map<std::string, size_t> index_;
+        std::mutex lock_;
+        std::mutex sched_lock_;
+        std::condition_variable sched_cond_;
+        std::vector<std::string> args_;
+        std::vector<TEST_HOOK> hooks_;
+        std::vector<REPORT_HOOK> reports_;
+        std::vector<FAIL_HOOK> fail_hooks_;
+        std::map<std::string, double> durations_;
+        std::map<std::string, int> shard_of_;
+        std::vector<std::string> filters_;
+        std::map<std::pair<std::string, int>, fail_site> sites_;
+        std::map<std::string, resource> resources_;
+        std::map<std::string, resource> level_resources_;
+    };
+    static unit_test& ut_test = unit_test::instance();
+
+    class ut_func_holder
+    {
+    public:
+        ut_func_holder(void* ptr, const char* func, bool first = false,
+            const char* file = "", int line = 0)
+        {
+            ut_test.add_func(ptr, func, first, file, line);
+        }
+    };
+
+    class ut_depend_holder
+    {
+    public:
+        ut_depend_holder(const char* b, const char* a)
+        {
+            ut_test.add_depend(b, a);
+        }
+    };
+
+    // base of a VTEST_CONSTEXPR body, every CEXPECT adds one char member
+    // so the size of the body less this byte is the number of checks
+    struct ut_constexpr_base
+    {
+        char ut_ce_base_;
+    };
+
+    template<class T>
+    void ut_constexpr_run()
+    {
+        unit_test::test_node* t = unit_test::current_test();
+        ut_test.add_static_checks(t ? t->fi.func.c_str() : "",
+            (int)(sizeof(T) - sizeof(ut_constexpr_base)));
+    }
+
+    class ut_resource_holder
+    {
+    public:
+        ut_resource_holder(const char* name, bool region, int threads, int mem,
+            bool exclusive)
+        {
+            ut_test.set_resource(name, region, threads, mem, exclusive);
+        }
+    };
+
+    // guard of a BAT_CHECK loop, with --batch-max-failures=K the loop stops
+    // after K failures but the test and the run go on
+    class ut_batch
+    {
+    public:
+        ut_batch() : limit_(ut_test.batch_limit()), start_(0)
+        {
+            if (limit_ > 0) start_ = ut_test.test_failures();
+        }
+        bool more(size_t i, size_t n)
+        {
+            if (limit_ <= 0 || ut_test.test_failures() - start_ < limit_) return true;
+            ut_cons.set_color_mode_tip();
+            printf("[Batch] stopped after %d failures at case %d of %d\n",
+                limit_, (int)i, (int)n);
+            ut_cons.reset_color_mode();
+            return false;
+        }
+    private:
+        int limit_;
+        int start_;
+    };
+
+    class ut_level_holder
+    {
+    public:
+        ut_level_holder(const char* level)
+        {
+            ut_test.set_level(level);
+        }
+    };
+
+#ifdef _MSC_VER
+    typedef __int8            ut_i8;
+    typedef __int16           ut_i16;
+    typedef __int32           ut_i32;
+    typedef __int64           ut_i64;
+    typedef unsigned __int8   ut_u8;
+    typedef unsigned __int16  ut_u16;
+    typedef unsigned __int32  ut_u32;
+    typedef unsigned __int64  ut_u64;
+#else
+    typedef signed char    ut_i8;
+    typedef short          ut_i16;
+    typedef int            ut_i32;
+    typedef long           ut_i64;
+    typedef unsigned char  ut_u8;
+    typedef unsigned short ut_u16;
+    typedef unsigned int   ut_u32;
+    typedef unsigned long  ut_u64;
+#endif
+
+    class ut_var
+    {
+    public:
+        ut_var(const bool v) { init(); t_ = UTD_BOOL; v_.b = v; }
+        ut_var(const ut_i8 v) { init(); t_ = UTD_CHAR; v_.c = v; }
+        ut_var(const ut_i16 v) { init(); t_ = UTD_SHORT; v_.s = v; }
+        ut_var(const ut_i32 v) { init(); t_ = UTD_INT; v_.i = v; }
+        ut_var(const ut_i64 v) { init(); t_ = UTD_INT64; v_.l = v; }
+        ut_var(const ut_u8 v) { init(); t_ = UTD_UCHAR; v_.c = v; }
+        ut_var(const ut_u16 v) { init(); t_ = UTD_USHORT; v_.s = v; }
+        ut_var(const ut_u32 v) { init(); t_ = UTD_UINT; v_.i = v; }
+        ut_var(const ut_u64 v) { init(); t_ = UTD_UINT64; v_.l = v; }
+        ut_var(const float v) { init(); t_ = UTD_FLOAT; v_.f = v; }
+        ut_var(const double v) { init(); t_ = UTD_DOUBLE; v_.r = v; }
+        ut_var(const char* v) { init(); t_ = UTD_STR; s_ = std::string(v); }
+        ut_var(const wchar_t* v) { init(); t_ = UTD_WSTR; ws_ = std::wstring(v); }
+        ut_var(const std::string& v) { init(); t_ = UTD_STR; s_ = v; }
+        ut_var(const std::wstring& v) { init();t_ = UTD_WSTR;  ws_ = v; }
+        ut_var() { init(); }
+        ut_var(const ut_var& other)
+        {
+            this->t_ = other.t_;
+            this->s_ = other.s_;
+            this->ws_ = other.ws_;
+            memcpy(&this->v_, &other.v_, 8);
+        }
+        ut_var& operator=(const ut_var& other)
+        {
+            this->t_ = other.t_;
+            this->s_ = other.s_;
+            this->ws_ = other.ws_;
+            memcpy(&this->v_, &other.v_, 8);
+            return (*this);
+        }
+        operator const char*() const { return s_.c_str(); }
+        operator const wchar_t*() const { return ws_.c_str(); }
         operator const std::string() const { return s_; }
         operator const std::wstring() const { return ws_; }
         operator const double() const { return v_.r; }
@@ -420,299 +1738,3554 @@ namespace vtest
         operator bool&() { return v_.b; }
         bool operator== (const ut_var& rh) const
         {
-            return is_equal(rh);
+            return is_equal(rh);
+        }
+        bool operator== (const bool v) const
+        {
+            return is_equal(ut_var(v));
+        }
+        bool operator== (const ut_i8 v) const
+        {
+            return is_equal(ut_var(v));
+        }
+        bool operator== (const ut_i16 v) const
+        {
+            return is_equal(ut_var(v));
+        }
+        bool operator== (const ut_i32 v) const
+        {
+            return is_equal(ut_var(v));
+        }
+        bool operator== (const ut_i64 v) const
+        {
+            return is_equal(ut_var(v));
+        }
+        bool operator== (const ut_u8 v) const
+        {
+            return is_equal(ut_var(v));
+        }
+        bool operator== (const ut_u16 v) const
+        {
+            return is_equal(ut_var(v));
+        }
+        bool operator== (const ut_u32 v) const
+        {
+            return is_equal(ut_var(v));
+        }
+        bool operator== (const ut_u64 v) const
+        {
+            return is_equal(ut_var(v));
+        }
+        bool operator== (const float v) const
+        {
+            return is_equal(ut_var(v));
+        }
+        bool operator== (const double v) const
+        {
+            return is_equal(ut_var(v));
+        }
+        bool operator== (const std::wstring& v) const
+        {
+            return ws_ == v;
+        }
+        bool operator== (const std::string& v) const
+        {
+            return s_ == v;
+        }
+        bool operator== (const wchar_t* v) const
+        {
+            return ws_ == v;
+        }
+        bool operator== (const char* v) const
+        {
+            return s_ == v;
+        }
+        bool operator!= (const ut_var& rh) const
+        {
+            return !is_equal(rh);
+        }
+        bool operator!= (const bool v) const
+        {
+            return !is_equal(ut_var(v));
+        }
+        bool operator!= (const ut_i8 v) const
+        {
+            return !is_equal(ut_var(v));
+        }
+        bool operator!= (const ut_i16 v) const
+        {
+            return !is_equal(ut_var(v));
+        }
+        bool operator!= (const ut_i32 v) const
+        {
+            return !is_equal(ut_var(v));
+        }
+        bool operator!= (const ut_i64 v) const
+        {
+            return !is_equal(ut_var(v));
+        }
+        bool operator!= (const ut_u8 v) const
+        {
+            return !is_equal(ut_var(v));
+        }
+        bool operator!= (const ut_u16 v) const
+        {
+            return !is_equal(ut_var(v));
+        }
+        bool operator!= (const ut_u32 v) const
+        {
+            return !is_equal(ut_var(v));
+        }
+        bool operator!= (const ut_u64 v) const
+        {
+            return !is_equal(ut_var(v));
+        }
+        bool operator!= (const float v) const
+        {
+            return !is_equal(ut_var(v));
+        }
+        bool operator!= (const double v) const
+        {
+            return !is_equal(ut_var(v));
+        }
+        bool operator!= (const std::wstring& v) const
+        {
+            return ws_ != v;
+        }
+        bool operator!= (const std::string& v) const
+        {
+            return s_ != v;
+        }
+        bool operator!= (const wchar_t* v) const
+        {
+            return ws_ != v;
+        }
+        bool operator!= (const char* v) const
+        {
+            return s_ != v;
+        }
+        std::string to_str()
+        {
+            char buf[64];
+            buf[0] = 0;
+            switch (t_)
+            {
+            case UTD_BOOL: snprintf(buf, 64, v_.b ? "true" : "false"); break;
+            case UTD_UCHAR: snprintf(buf, 64, "%u", v_.c); break;
+            case UTD_CHAR: snprintf(buf, 64, "%c", v_.c); break;
+            case UTD_USHORT: snprintf(buf, 64, "%u", v_.s); break;
+            case UTD_SHORT: snprintf(buf, 64, "%d", v_.s); break;
+            case UTD_UINT: snprintf(buf, 64, "%u", v_.i); break;
+            case UTD_INT: snprintf(buf, 64, "%d", v_.i); break;
+#ifdef _MSC_VER
+            case UTD_UINT64: snprintf(buf, 64, "%llu", v_.l); break;
+            case UTD_INT64: snprintf(buf, 64, "%lld", v_.l); break;
+#else
+            case UTD_UINT64: snprintf(buf, 64, "%lu", v_.l); break;
+            case UTD_INT64: snprintf(buf, 64, "%li", v_.l); break;
+#endif
+            case UTD_FLOAT: snprintf(buf, 64, "%f", v_.f); break;
+            case UTD_DOUBLE: snprintf(buf, 64, "%f", v_.r); break;
+            case UTD_STR: return s_.c_str();
+                //case UTD_WSTR: return ws_.c_str();
+            default:
+                break;
+            }
+            return std::string(buf);
+        }
+    private:
+        inline void init()
+        {
+            t_ = UTD_BOOL;
+            memset(&v_, 0, sizeof(number));
+        }
+        bool is_equal(const ut_var& rh) const
+        {
+            if (t_ == UTD_BOOL)
+            {
+                if (rh.t_ == UTD_BOOL) {
+                    return v_.b == rh.v_.b;
+                }
+                else if (rh.t_ == UTD_FLOAT || rh.t_ == UTD_DOUBLE) {
+                    return v_.b == (abs(rh.to_double()) > 0.00000000001);
+                }
+                else if (rh.t_ >= UTD_NUM_START && rh.t_ <= UTD_NUM_END) {
+                    return v_.b == (rh.to_u64() > 0);
+                }
+                return false;
+            }
+            else if (t_ == UTD_FLOAT || t_ == UTD_DOUBLE)
+            {
+                if (rh.t_ == UTD_BOOL) {
+                    return rh.v_.b == (abs(to_double()) > 0.00000000001);
+                }
+                else if (rh.t_ == UTD_FLOAT || rh.t_ == UTD_DOUBLE) {
+                    return abs(to_double() - rh.to_double()) < 0.00000000001;
+                }
+                else if (rh.t_ >= UTD_NUM_START && rh.t_ <= UTD_NUM_END) {
+                    return abs(to_double() - rh.to_u64()) < 0.00000000001;
+                }
+                return false;
+            }
+            else if (t_ >= UTD_NUM_START && t_ <= UTD_NUM_END)
+            {
+                if (rh.t_ == UTD_BOOL) {
+                    return rh.v_.b == (to_u64() > 0);
+                }
+                else if (rh.t_ == UTD_FLOAT || rh.t_ == UTD_DOUBLE) {
+                    return abs(to_u64() - rh.to_double()) < 0.00000000001;
+                }
+                else if (rh.t_ >= UTD_NUM_START && rh.t_ <= UTD_NUM_END) {
+                    return to_u64() == rh.to_u64();
+                }
+                return false;
+            }
+            else if (t_ == UTD_STR)
+            {
+                if (rh.t_ == UTD_STR) return s_ == rh.s_;
+                return false;
+            }
+            else if (t_ == UTD_WSTR)
+            {
+                if (rh.t_ == UTD_WSTR) return ws_ == rh.ws_;
+                return false;
+            }
+            return false;
+        }
+        double to_double() const
+        {
+            switch (t_)
+            {
+            case UTD_FLOAT: return v_.f;
+            case UTD_DOUBLE: return v_.r;
+            default:
+                break;
+            }
+            return 0.F;
+        }
+        ut_u64 to_u64() const
+        {
+            switch (t_)
+            {
+            case UTD_CHAR:
+            case UTD_UCHAR: return v_.c;
+            case UTD_SHORT:
+            case UTD_USHORT: return v_.s;
+            case UTD_INT:
+            case UTD_UINT: return v_.i;
+            case UTD_INT64:
+            case UTD_UINT64: return v_.l;
+            default:
+                break;
+            }
+            return 0;
+        }
+    private:
+        enum UT_DATA_TYPE
+        {
+            UTD_BOOL = 1,
+            UTD_CHAR, UTD_SHORT, UTD_INT, UTD_INT64,
+            UTD_UCHAR, UTD_USHORT, UTD_UINT, UTD_UINT64,
+            UTD_FLOAT, UTD_DOUBLE, UTD_STR, UTD_WSTR,
+            UTD_NUM_START = UTD_CHAR,
+            UTD_NUM_END = UTD_UINT64
+        };
+        union number
+        {
+            bool b;
+            ut_i8 c;
+            ut_i16 s;
+            ut_i32 i;
+            ut_i64 l;
+            float f;
+            double r;
+        } v_;
+        UT_DATA_TYPE t_;
+        std::string s_;
+        std::wstring ws_;
+    };
+    typedef std::vector<std::vector<ut_var> > ut_vars;
+
+    class kv_cache
+    {
+    public:
+        void set(const std::string& key, ut_var v)
+        {
+            kv_[key] = v;
+        }
+        ut_var get(const std::string& key)
+        {
+            if (kv_.find(key) != kv_.end()) {
+                return kv_[key];
+            }
+            else {
+                return ut_var();
+            }
+        }
+        static kv_cache& instance()
+        {
+            static kv_cache obj_;
+            return obj_;
+        }
+    private:
+        UT_HASH_MAP<std::string, ut_var> kv_;
+    };
+    static kv_cache& ut_kv = kv_cache::instance();
+
+    inline int ut_ctz(ut_u32 v)
+    {
+#ifdef _MSC_VER
+        unsigned long i;
+        _BitScanForward(&i, v);
+        return (int)i;
+#else
+        return __builtin_ctz(v);
+#endif
+    }
+
+    inline int ut_msb64(ut_u64 v)
+    {
+#ifdef _MSC_VER
+        unsigned long i;
+        _BitScanReverse64(&i, v);
+        return (int)i;
+#else
+        return 63 - __builtin_clzll(v);
+#endif
+    }
+
+    inline int ut_popcount(ut_u32 v)
+    {
+#ifdef _MSC_VER
+        v = v - ((v >> 1) & 0x55555555);
+        v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
+        return (int)((((v + (v >> 4)) & 0x0f0f0f0f) * 0x01010101) >> 24);
+#else
+        return __builtin_popcount(v);
+#endif
+    }
+
+    class ut_array_result
+    {
+    public:
+        ut_array_result(size_t n, bool by_ulp)
+        {
+            n_ = n;
+            count_ = 0;
+            max_abs_ = 0;
+            max_rel_ = 0;
+            by_ulp_ = by_ulp;
+        }
+        template <typename T>
+        void add(size_t i, T a, T b)
+        {
+            if (count_ < VTEST_ARRAY_REPORT) {
+                idx_[count_] = i;
+                a_[count_] = a;
+                b_[count_] = b;
+                ulp_[count_] = ulp_dist(a, b);
+            }
+            count_++;
+        }
+        void add_err(double abs_err, double rel_err)
+        {
+            if (abs_err > max_abs_) max_abs_ = abs_err;
+            if (rel_err > max_rel_) max_rel_ = rel_err;
+        }
+        size_t count() const { return count_; }
+        void show()
+        {
+            ut_cons.set_color_mode_tip();
+            printf("Array mismatch: %llu of %llu elements, "
+                "max abs error %g, max rel error %g\n",
+                (unsigned long long)count_, (unsigned long long)n_,
+                max_abs_, max_rel_);
+            for (size_t i = 0; i < count_ && i < VTEST_ARRAY_REPORT; i++) {
+                printf("  [%llu] Expect: %.17g, Return Value: %.17g",
+                    (unsigned long long)idx_[i], a_[i], b_[i]);
+                if (by_ulp_) {
+                    printf(", ulp %llu\n", (unsigned long long)ulp_[i]);
+                }
+                else {
+                    printf(", abs error %g\n", fabs(a_[i] - b_[i]));
+                }
+            }
+            ut_cons.reset_color_mode();
+        }
+        // distance in units in the last place, NaN is always far away
+        static ut_u64 ulp_dist(float a, float b)
+        {
+            if (a != a || b != b) return (ut_u64)-1;
+            ut_u32 ia, ib;
+            memcpy(&ia, &a, 4);
+            memcpy(&ib, &b, 4);
+            ut_u64 ma = ia & 0x7fffffffu, mb = ib & 0x7fffffffu;
+            if ((ia ^ ib) & 0x80000000u) return ma + mb;
+            return ma > mb ? ma - mb : mb - ma;
+        }
+        static ut_u64 ulp_dist(double a, double b)
+        {
+            if (a != a || b != b) return (ut_u64)-1;
+            ut_u64 ia, ib;
+            memcpy(&ia, &a, 8);
+            memcpy(&ib, &b, 8);
+            const ut_u64 sign = (ut_u64)1 << 63;
+            ut_u64 ma = ia & ~sign, mb = ib & ~sign;
+            if ((ia ^ ib) & sign) return ma + mb;
+            return ma > mb ? ma - mb : mb - ma;
+        }
+    private:
+        size_t n_;
+        size_t count_;
+        double max_abs_;
+        double max_rel_;
+        bool by_ulp_;
+        size_t idx_[VTEST_ARRAY_REPORT];
+        double a_[VTEST_ARRAY_REPORT];
+        double b_[VTEST_ARRAY_REPORT];
+        ut_u64 ulp_[VTEST_ARRAY_REPORT];
+    };
+
+    // compare float/double arrays by absolute tolerance or ulp distance,
+    // the main loop is vectorized, mismatching lanes and the tail are
+    // handled by the scalar code
+    class ut_array_cmp
+    {
+    public:
+        static ut_array_result within_tol(const float* a, const float* b,
+            size_t n, double tol)
+        {
+            return scan(a, b, n, tol, 0, false);
+        }
+        static ut_array_result within_tol(const double* a, const double* b,
+            size_t n, double tol)
+        {
+            return scan(a, b, n, tol, 0, false);
+        }
+        static ut_array_result within_ulp(const float* a, const float* b,
+            size_t n, ut_u64 maxulp)
+        {
+            return scan(a, b, n, 0, maxulp, true);
+        }
+        static ut_array_result within_ulp(const double* a, const double* b,
+            size_t n, ut_u64 maxulp)
+        {
+            return scan(a, b, n, 0, maxulp, true);
+        }
+    private:
+        template <typename T>
+        static ut_array_result scan(const T* a, const T* b, size_t n,
+            double tol, ut_u64 maxulp, bool by_ulp)
+        {
+            ut_array_result r(n, by_ulp);
+            size_t i = simd_scan(a, b, n, tol, maxulp, by_ulp, r);
+            for (; i < n; i++) {
+                check(a, b, i, tol, maxulp, by_ulp, r);
+            }
+            return r;
+        }
+        template <typename T>
+        static void check(const T* a, const T* b, size_t i,
+            double tol, ut_u64 maxulp, bool by_ulp, ut_array_result& r)
+        {
+            double va = a[i], vb = b[i];
+            double d = (va == vb) ? 0 : fabs(va - vb);
+            double m = fabs(va) > fabs(vb) ? fabs(va) : fabs(vb);
+            if (d == d) {
+                r.add_err(d, m > 0 ? d / m : 0);
+            }
+            bool ok = by_ulp ? ut_array_result::ulp_dist(a[i], b[i]) <= maxulp
+                : d <= tol;
+            if (!ok) r.add(i, a[i], b[i]);
+        }
+        template <typename T>
+        static void check_mask(const T* a, const T* b, size_t i, ut_u32 bad,
+            ut_array_result& r)
+        {
+            while (bad) {
+                size_t k = i + ut_ctz(bad);
+                r.add(k, a[k], b[k]);
+                bad &= bad - 1;
+            }
+        }
+        // the float lanes compare with a bound one float below tol, so a lane
+        // passes only when the double compare would pass too, the lanes
+        // near tol are decided by check() like the tail
+        static float tol_below(double tol)
+        {
+            float t = (float)tol;
+            if ((double)t > tol) t = nextafterf(t, -HUGE_VALF);
+            return t > 0 ? nextafterf(t, 0) : t;
+        }
+        static void check_lanes(const float* a, const float* b, size_t i,
+            ut_u32 bad, double tol, ut_array_result& r)
+        {
+            while (bad) {
+                check(a, b, i + ut_ctz(bad), tol, 0, false, r);
+                bad &= bad - 1;
+            }
+        }
+        static void reduce(const double* abs_err, const double* rel_err,
+            int lanes, ut_array_result& r)
+        {
+            for (int k = 0; k < lanes; k++) {
+                r.add_err(abs_err[k], rel_err[k]);
+            }
+        }
+#if defined(VTEST_SIMD_AVX2)
+        static size_t simd_scan(const float* a, const float* b, size_t n,
+            double tol, ut_u64 maxulp, bool by_ulp, ut_array_result& r)
+        {
+            const __m256 sign = _mm256_set1_ps(-0.0f);
+            const __m256i mag = _mm256_set1_epi32(0x7fffffff);
+            const __m256i bias = _mm256_set1_epi32((int)0x80000000);
+            const __m256i lim = _mm256_xor_si256(bias, _mm256_set1_epi32(
+                (int)(maxulp > 0xffffffffu ? 0xffffffffu : (ut_u32)maxulp)));
+            const __m256 vtol = _mm256_set1_ps(tol_below(tol));
+            __m256 vabs = _mm256_setzero_ps(), vrel = _mm256_setzero_ps();
+            size_t i = 0;
+            for (; i + 8 <= n; i += 8) {
+                __m256 va = _mm256_loadu_ps(a + i), vb = _mm256_loadu_ps(b + i);
+                __m256 eq = _mm256_cmp_ps(va, vb, _CMP_EQ_OQ);
+                __m256 d = _mm256_andnot_ps(eq,
+                    _mm256_andnot_ps(sign, _mm256_sub_ps(va, vb)));
+                __m256 m = _mm256_max_ps(_mm256_andnot_ps(sign, va),
+                    _mm256_andnot_ps(sign, vb));
+                vabs = _mm256_max_ps(d, vabs);
+                vrel = _mm256_max_ps(_mm256_div_ps(d, m), vrel);
+                int bad;
+                if (by_ulp) {
+                    __m256i ia = _mm256_castps_si256(va);
+                    __m256i ib = _mm256_castps_si256(vb);
+                    __m256i ma = _mm256_and_si256(ia, mag);
+                    __m256i mb = _mm256_and_si256(ib, mag);
+                    __m256i sd = _mm256_srai_epi32(_mm256_xor_si256(ia, ib), 31);
+                    __m256i dist = _mm256_blendv_epi8(
+                        _mm256_abs_epi32(_mm256_sub_epi32(ma, mb)),
+                        _mm256_add_epi32(ma, mb), sd);
+                    __m256i gt = _mm256_cmpgt_epi32(
+                        _mm256_xor_si256(dist, bias), lim);
+                    bad = _mm256_movemask_ps(_mm256_or_ps(_mm256_castsi256_ps(gt),
+                        _mm256_cmp_ps(va, vb, _CMP_UNORD_Q)));
+                }
+                else {
+                    bad = ~_mm256_movemask_ps(
+                        _mm256_cmp_ps(d, vtol, _CMP_LE_OQ)) & 0xff;
+                }
+                if (bad && by_ulp) check_mask(a, b, i, (ut_u32)bad, r);
+                else if (bad) check_lanes(a, b, i, (ut_u32)bad, tol, r);
+            }
+            float fa[8], fr[8];
+            double da[8], dr[8];
+            _mm256_storeu_ps(fa, vabs);
+            _mm256_storeu_ps(fr, vrel);
+            for (int k = 0; k < 8; k++) {
+                da[k] = fa[k];
+                dr[k] = fr[k];
+            }
+            reduce(da, dr, 8, r);
+            return i;
+        }
+        static size_t simd_scan(const double* a, const double* b, size_t n,
+            double tol, ut_u64 maxulp, bool by_ulp, ut_array_result& r)
+        {
+            const __m256d sign = _mm256_set1_pd(-0.0);
+            const __m256i zero = _mm256_setzero_si256();
+            const __m256i mag = _mm256_set1_epi64x(0x7fffffffffffffffLL);
+            const __m256i bias = _mm256_set1_epi64x((long long)((ut_u64)1 << 63));
+            const __m256i lim = _mm256_xor_si256(bias,
+                _mm256_set1_epi64x((long long)maxulp));
+            const __m256d vtol = _mm256_set1_pd(tol);
+            __m256d vabs = _mm256_setzero_pd(), vrel = _mm256_setzero_pd();
+            size_t i = 0;
+            for (; i + 4 <= n; i += 4) {
+                __m256d va = _mm256_loadu_pd(a + i), vb = _mm256_loadu_pd(b + i);
+                __m256d eq = _mm256_cmp_pd(va, vb, _CMP_EQ_OQ);
+                __m256d d = _mm256_andnot_pd(eq,
+                    _mm256_andnot_pd(sign, _mm256_sub_pd(va, vb)));
+                __m256d m = _mm256_max_pd(_mm256_andnot_pd(sign, va),
+                    _mm256_andnot_pd(sign, vb));
+                vabs = _mm256_max_pd(d, vabs);
+                vrel = _mm256_max_pd(_mm256_div_pd(d, m), vrel);
+                int bad;
+                if (by_ulp) {
+                    __m256i ia = _mm256_castpd_si256(va);
+                    __m256i ib = _mm256_castpd_si256(vb);
+                    __m256i ma = _mm256_and_si256(ia, mag);
+                    __m256i mb = _mm256_and_si256(ib, mag);
+                    __m256i sd = _mm256_cmpgt_epi64(zero, _mm256_xor_si256(ia, ib));
+                    __m256i diff = _mm256_sub_epi64(ma, mb);
+                    __m256i neg = _mm256_cmpgt_epi64(zero, diff);
+                    diff = _mm256_sub_epi64(_mm256_xor_si256(diff, neg), neg);
+                    __m256i dist = _mm256_blendv_epi8(diff,
+                        _mm256_add_epi64(ma, mb), sd);
+                    __m256i gt = _mm256_cmpgt_epi64(
+                        _mm256_xor_si256(dist, bias), lim);
+                    bad = _mm256_movemask_pd(_mm256_or_pd(_mm256_castsi256_pd(gt),
+                        _mm256_cmp_pd(va, vb, _CMP_UNORD_Q)));
+                }
+                else {
+                    bad = ~_mm256_movemask_pd(
+                        _mm256_cmp_pd(d, vtol, _CMP_LE_OQ)) & 0xf;
+                }
+                if (bad) check_mask(a, b, i, (ut_u32)bad, r);
+            }
+            double da[4], dr[4];
+            _mm256_storeu_pd(da, vabs);
+            _mm256_storeu_pd(dr, vrel);
+            reduce(da, dr, 4, r);
+            return i;
+        }
+#elif defined(VTEST_SIMD_SSE2)
+        static size_t simd_scan(const float* a, const float* b, size_t n,
+            double tol, ut_u64 maxulp, bool by_ulp, ut_array_result& r)
+        {
+            const __m128 sign = _mm_set1_ps(-0.0f);
+            const __m128i mag = _mm_set1_epi32(0x7fffffff);
+            const __m128i bias = _mm_set1_epi32((int)0x80000000);
+            const __m128i lim = _mm_xor_si128(bias, _mm_set1_epi32(
+                (int)(maxulp > 0xffffffffu ? 0xffffffffu : (ut_u32)maxulp)));
+            const __m128 vtol = _mm_set1_ps(tol_below(tol));
+            __m128 vabs = _mm_setzero_ps(), vrel = _mm_setzero_ps();
+            size_t i = 0;
+            for (; i + 4 <= n; i += 4) {
+                __m128 va = _mm_loadu_ps(a + i), vb = _mm_loadu_ps(b + i);
+                __m128 eq = _mm_cmpeq_ps(va, vb);
+                __m128 d = _mm_andnot_ps(eq,
+                    _mm_andnot_ps(sign, _mm_sub_ps(va, vb)));
+                __m128 m = _mm_max_ps(_mm_andnot_ps(sign, va),
+                    _mm_andnot_ps(sign, vb));
+                vabs = _mm_max_ps(d, vabs);
+                vrel = _mm_max_ps(_mm_div_ps(d, m), vrel);
+                int bad;
+                if (by_ulp) {
+                    __m128i ia = _mm_castps_si128(va);
+                    __m128i ib = _mm_castps_si128(vb);
+                    __m128i ma = _mm_and_si128(ia, mag);
+                    __m128i mb = _mm_and_si128(ib, mag);
+                    __m128i sd = _mm_srai_epi32(_mm_xor_si128(ia, ib), 31);
+                    __m128i diff = _mm_sub_epi32(ma, mb);
+                    __m128i neg = _mm_srai_epi32(diff, 31);
+                    diff = _mm_sub_epi32(_mm_xor_si128(diff, neg), neg);
+                    __m128i dist = _mm_or_si128(_mm_andnot_si128(sd, diff),
+                        _mm_and_si128(sd, _mm_add_epi32(ma, mb)));
+                    __m128i gt = _mm_cmpgt_epi32(_mm_xor_si128(dist, bias), lim);
+                    bad = _mm_movemask_ps(_mm_or_ps(_mm_castsi128_ps(gt),
+                        _mm_cmpunord_ps(va, vb)));
+                }
+                else {
+                    bad = ~_mm_movemask_ps(_mm_cmple_ps(d, vtol)) & 0xf;
+                }
+                if (bad && by_ulp) check_mask(a, b, i, (ut_u32)bad, r);
+                else if (bad) check_lanes(a, b, i, (ut_u32)bad, tol, r);
+            }
+            float fa[4], fr[4];
+            double da[4], dr[4];
+            _mm_storeu_ps(fa, vabs);
+            _mm_storeu_ps(fr, vrel);
+            for (int k = 0; k < 4; k++) {
+                da[k] = fa[k];
+                dr[k] = fr[k];
+            }
+            reduce(da, dr, 4, r);
+            return i;
+        }
+        static size_t simd_scan(const double* a, const double* b, size_t n,
+            double tol, ut_u64 maxulp, bool by_ulp, ut_array_result& r)
+        {
+#ifndef __SSE4_2__
+            // 64-bit compare needs SSE4.2, leave the ulp check to the scalar loop
+            (void)maxulp;
+            if (by_ulp) return 0;
+#endif
+            const __m128d sign = _mm_set1_pd(-0.0);
+            const __m128d vtol = _mm_set1_pd(tol);
+            __m128d vabs = _mm_setzero_pd(), vrel = _mm_setzero_pd();
+            size_t i = 0;
+            for (; i + 2 <= n; i += 2) {
+                __m128d va = _mm_loadu_pd(a + i), vb = _mm_loadu_pd(b + i);
+                __m128d eq = _mm_cmpeq_pd(va, vb);
+                __m128d d = _mm_andnot_pd(eq,
+                    _mm_andnot_pd(sign, _mm_sub_pd(va, vb)));
+                __m128d m = _mm_max_pd(_mm_andnot_pd(sign, va),
+                    _mm_andnot_pd(sign, vb));
+                vabs = _mm_max_pd(d, vabs);
+                vrel = _mm_max_pd(_mm_div_pd(d, m), vrel);
+                int bad;
+                if (by_ulp) {
+#ifdef __SSE4_2__
+                    const __m128i zero = _mm_setzero_si128();
+                    const __m128i mag = _mm_set1_epi64x(0x7fffffffffffffffLL);
+                    const __m128i bias = _mm_set1_epi64x(
+                        (long long)((ut_u64)1 << 63));
+                    const __m128i lim = _mm_xor_si128(bias,
+                        _mm_set1_epi64x((long long)maxulp));
+                    __m128i ia = _mm_castpd_si128(va);
+                    __m128i ib = _mm_castpd_si128(vb);
+                    __m128i ma = _mm_and_si128(ia, mag);
+                    __m128i mb = _mm_and_si128(ib, mag);
+                    __m128i sd = _mm_cmpgt_epi64(zero, _mm_xor_si128(ia, ib));
+                    __m128i diff = _mm_sub_epi64(ma, mb);
+                    __m128i neg = _mm_cmpgt_epi64(zero, diff);
+                    diff = _mm_sub_epi64(_mm_xor_si128(diff, neg), neg);
+                    __m128i dist = _mm_or_si128(_mm_andnot_si128(sd, diff),
+                        _mm_and_si128(sd, _mm_add_epi64(ma, mb)));
+                    __m128i gt = _mm_cmpgt_epi64(_mm_xor_si128(dist, bias), lim);
+                    bad = _mm_movemask_pd(_mm_or_pd(_mm_castsi128_pd(gt),
+                        _mm_cmpunord_pd(va, vb)));
+#else
+                    bad = 0;
+#endif
+                }
+                else {
+                    bad = ~_mm_movemask_pd(_mm_cmple_pd(d, vtol)) & 0x3;
+                }
+                if (bad) check_mask(a, b, i, (ut_u32)bad, r);
+            }
+            double da[2], dr[2];
+            _mm_storeu_pd(da, vabs);
+            _mm_storeu_pd(dr, vrel);
+            reduce(da, dr, 2, r);
+            return i;
+        }
+#elif defined(VTEST_SIMD_NEON)
+        static size_t simd_scan(const float* a, const float* b, size_t n,
+            double tol, ut_u64 maxulp, bool by_ulp, ut_array_result& r)
+        {
+            const uint32x4_t mag = vdupq_n_u32(0x7fffffffu);
+            const uint32x4_t lim = vdupq_n_u32(
+                maxulp > 0xffffffffu ? 0xffffffffu : (ut_u32)maxulp);
+            const ut_u32 lanes[4] = { 1, 2, 4, 8 };
+            const uint32x4_t bits = vld1q_u32(lanes);
+            const float32x4_t vtol = vdupq_n_f32(tol_below(tol));
+            float32x4_t vabs = vdupq_n_f32(0), vrel = vdupq_n_f32(0);
+            size_t i = 0;
+            for (; i + 4 <= n; i += 4) {
+                float32x4_t va = vld1q_f32(a + i), vb = vld1q_f32(b + i);
+                uint32x4_t eq = vceqq_f32(va, vb);
+                float32x4_t d = vreinterpretq_f32_u32(vbicq_u32(
+                    vreinterpretq_u32_f32(vabdq_f32(va, vb)), eq));
+                float32x4_t m = vmaxq_f32(vabsq_f32(va), vabsq_f32(vb));
+                vabs = vmaxnmq_f32(vabs, d);
+                vrel = vmaxnmq_f32(vrel, vdivq_f32(d, m));
+                uint32x4_t badv;
+                if (by_ulp) {
+                    uint32x4_t ia = vreinterpretq_u32_f32(va);
+                    uint32x4_t ib = vreinterpretq_u32_f32(vb);
+                    uint32x4_t ma = vandq_u32(ia, mag), mb = vandq_u32(ib, mag);
+                    uint32x4_t sd = vcltq_s32(vreinterpretq_s32_u32(
+                        veorq_u32(ia, ib)), vdupq_n_s32(0));
+                    uint32x4_t dist = vbslq_u32(sd, vaddq_u32(ma, mb),
+                        vabdq_u32(ma, mb));
+                    uint32x4_t num = vandq_u32(vceqq_f32(va, va), vceqq_f32(vb, vb));
+                    badv = vorrq_u32(vcgtq_u32(dist, lim), vmvnq_u32(num));
+                }
+                else {
+                    badv = vmvnq_u32(vcleq_f32(d, vtol));
+                }
+                ut_u32 bad = vaddvq_u32(vandq_u32(badv, bits));
+                if (bad && by_ulp) check_mask(a, b, i, bad, r);
+                else if (bad) check_lanes(a, b, i, bad, tol, r);
+            }
+            float fa[4], fr[4];
+            double da[4], dr[4];
+            vst1q_f32(fa, vabs);
+            vst1q_f32(fr, vrel);
+            for (int k = 0; k < 4; k++) {
+                da[k] = fa[k];
+                dr[k] = fr[k];
+            }
+            reduce(da, dr, 4, r);
+            return i;
+        }
+        static size_t simd_scan(const double* a, const double* b, size_t n,
+            double tol, ut_u64 maxulp, bool by_ulp, ut_array_result& r)
+        {
+            const uint64x2_t mag = vdupq_n_u64(0x7fffffffffffffffULL);
+            const uint64x2_t lim = vdupq_n_u64(maxulp);
+            const uint64_t lanes[2] = { 1, 2 };
+            const uint64x2_t bits = vld1q_u64(lanes);
+            const float64x2_t vtol = vdupq_n_f64(tol);
+            float64x2_t vabs = vdupq_n_f64(0), vrel = vdupq_n_f64(0);
+            size_t i = 0;
+            for (; i + 2 <= n; i += 2) {
+                float64x2_t va = vld1q_f64(a + i), vb = vld1q_f64(b + i);
+                uint64x2_t eq = vceqq_f64(va, vb);
+                float64x2_t d = vreinterpretq_f64_u64(vbicq_u64(
+                    vreinterpretq_u64_f64(vabdq_f64(va, vb)), eq));
+                float64x2_t m = vmaxq_f64(vabsq_f64(va), vabsq_f64(vb));
+                vabs = vmaxnmq_f64(vabs, d);
+                vrel = vmaxnmq_f64(vrel, vdivq_f64(d, m));
+                uint64x2_t badv;
+                if (by_ulp) {
+                    uint64x2_t ia = vreinterpretq_u64_f64(va);
+                    uint64x2_t ib = vreinterpretq_u64_f64(vb);
+                    uint64x2_t ma = vandq_u64(ia, mag), mb = vandq_u64(ib, mag);
+                    uint64x2_t sd = vcltq_s64(vreinterpretq_s64_u64(
+                        veorq_u64(ia, ib)), vdupq_n_s64(0));
+                    uint64x2_t gt = vcgtq_u64(ma, mb);
+                    uint64x2_t diff = vsubq_u64(vbslq_u64(gt, ma, mb),
+                        vbslq_u64(gt, mb, ma));
+                    uint64x2_t dist = vbslq_u64(sd, vaddq_u64(ma, mb), diff);
+                    uint64x2_t num = vandq_u64(vceqq_f64(va, va), vceqq_f64(vb, vb));
+                    badv = vorrq_u64(vcgtq_u64(dist, lim),
+                        veorq_u64(num, vdupq_n_u64(~0ULL)));
+                }
+                else {
+                    badv = veorq_u64(vcleq_f64(d, vtol), vdupq_n_u64(~0ULL));
+                }
+                ut_u32 bad = (ut_u32)vaddvq_u64(vandq_u64(badv, bits));
+                if (bad) check_mask(a, b, i, bad, r);
+            }
+            double da[2], dr[2];
+            vst1q_f64(da, vabs);
+            vst1q_f64(dr, vrel);
+            reduce(da, dr, 2, r);
+            return i;
+        }
+#else
+        template <typename T>
+        static size_t simd_scan(const T*, const T*, size_t, double, ut_u64,
+            bool, ut_array_result&)
+        {
+            return 0;
+        }
+#endif
+    };
+
+    class ut_buffer_result
+    {
+    public:
+        ut_buffer_result(const void* a, const void* b, size_t n)
+        {
+            a_ = (const ut_u8*)a;
+            b_ = (const ut_u8*)b;
+            n_ = n;
+            count_ = 0;
+            sites_ = 0;
+            more_ = false;
+        }
+        // mask holds one bit per differing byte starting at off
+        void add(size_t off, ut_u32 mask)
+        {
+            count_ += ut_popcount(mask);
+            while (mask && !more_) {
+                size_t k = off + ut_ctz(mask);
+                if (sites_ == 0 || k >= site_[sites_ - 1] + WINDOW) {
+                    if (sites_ == VTEST_BUFFER_REPORT) {
+                        more_ = true;
+                    }
+                    else {
+                        site_[sites_++] = k;
+                    }
+                }
+                mask &= mask - 1;
+            }
+        }
+        size_t count() const { return count_; }
+        size_t first() const { return sites_ > 0 ? site_[0] : n_; }
+        void show()
+        {
+            ut_cons.set_color_mode_tip();
+            printf("Buffer mismatch: %llu of %llu bytes differ, "
+                "first at offset %llu\n", (unsigned long long)count_,
+                (unsigned long long)n_, (unsigned long long)first());
+            size_t shown = 0;
+            for (size_t i = 0; i < sites_; i++) {
+                size_t lo = site_[i] / ROW * ROW;
+                lo = lo >= WINDOW ? lo - WINDOW : 0;
+                if (lo < shown) lo = shown;
+                size_t hi = site_[i] / ROW * ROW + ROW + WINDOW;
+                if (hi > n_) hi = n_;
+                if (lo >= hi) continue;
+                if (lo > shown || i == 0) {
+                    printf("  offset            expect%*s| return value\n",
+                        ROW * 3 - 6, "");
+                }
+                for (size_t row = lo; row < hi; row += ROW) {
+                    printf("  %016llx  ", (unsigned long long)row);
+                    dump_row(a_, row, hi);
+                    printf("| ");
+                    dump_row(b_, row, hi);
+                    printf("\n");
+                }
+                shown = hi;
+            }
+            if (more_) {
+                printf("  ...\n");
+            }
+            ut_cons.reset_color_mode();
+        }
+    private:
+        enum { ROW = 16, WINDOW = 32 };
+        void dump_row(const ut_u8* p, size_t row, size_t hi)
+        {
+            for (size_t k = row; k < row + ROW; k++) {
+                if (k >= hi) {
+                    printf("   ");
+                }
+                else if (a_[k] != b_[k]) {
+                    ut_cons.set_color_mode_failed();
+                    printf("%02x ", p[k]);
+                    ut_cons.set_color_mode_tip();
+                }
+                else {
+                    printf("%02x ", p[k]);
+                }
+            }
+        }
+    private:
+        const ut_u8* a_;
+        const ut_u8* b_;
+        size_t n_;
+        size_t count_;
+        size_t sites_;
+        size_t site_[VTEST_BUFFER_REPORT];
+        bool more_;
+    };
+
+    // byte-wise compare of two buffers in place, the whole buffer is always
+    // scanned so the number of differing bytes is exact
+    class ut_buffer_cmp
+    {
+    public:
+        static ut_buffer_result compare(const void* a, const void* b, size_t n)
+        {
+            ut_buffer_result r(a, b, n);
+            const ut_u8* pa = (const ut_u8*)a;
+            const ut_u8* pb = (const ut_u8*)b;
+            size_t i = simd_scan(pa, pb, n, r);
+            for (; i + 8 <= n; i += 8) {
+                ut_u64 wa, wb;
+                memcpy(&wa, pa + i, 8);
+                memcpy(&wb, pb + i, 8);
+                if (wa != wb) scan_tail(pa, pb, i, i + 8, r);
+            }
+            scan_tail(pa, pb, i, n, r);
+            return r;
+        }
+    private:
+        static void scan_tail(const ut_u8* a, const ut_u8* b, size_t i,
+            size_t n, ut_buffer_result& r)
+        {
+            ut_u32 mask = 0;
+            for (size_t k = i; k < n; k++) {
+                if (a[k] != b[k]) mask |= 1u << (k - i);
+            }
+            if (mask) r.add(i, mask);
+        }
+#if defined(VTEST_SIMD_AVX2)
+        static size_t simd_scan(const ut_u8* a, const ut_u8* b, size_t n,
+            ut_buffer_result& r)
+        {
+            size_t i = 0;
+            for (; i + 128 <= n; i += 128) {
+                __m256i e0 = _mm256_cmpeq_epi8(
+                    _mm256_loadu_si256((const __m256i*)(a + i)),
+                    _mm256_loadu_si256((const __m256i*)(b + i)));
+                __m256i e1 = _mm256_cmpeq_epi8(
+                    _mm256_loadu_si256((const __m256i*)(a + i + 32)),
+                    _mm256_loadu_si256((const __m256i*)(b + i + 32)));
+                __m256i e2 = _mm256_cmpeq_epi8(
+                    _mm256_loadu_si256((const __m256i*)(a + i + 64)),
+                    _mm256_loadu_si256((const __m256i*)(b + i + 64)));
+                __m256i e3 = _mm256_cmpeq_epi8(
+                    _mm256_loadu_si256((const __m256i*)(a + i + 96)),
+                    _mm256_loadu_si256((const __m256i*)(b + i + 96)));
+                __m256i all = _mm256_and_si256(_mm256_and_si256(e0, e1),
+                    _mm256_and_si256(e2, e3));
+                if ((ut_u32)_mm256_movemask_epi8(all) == 0xffffffffu) continue;
+                r.add(i, ~(ut_u32)_mm256_movemask_epi8(e0));
+                r.add(i + 32, ~(ut_u32)_mm256_movemask_epi8(e1));
+                r.add(i + 64, ~(ut_u32)_mm256_movemask_epi8(e2));
+                r.add(i + 96, ~(ut_u32)_mm256_movemask_epi8(e3));
+            }
+            return i;
+        }
+#elif defined(VTEST_SIMD_SSE2)
+        static size_t simd_scan(const ut_u8* a, const ut_u8* b, size_t n,
+            ut_buffer_result& r)
+        {
+            size_t i = 0;
+            for (; i + 64 <= n; i += 64) {
+                __m128i e0 = _mm_cmpeq_epi8(
+                    _mm_loadu_si128((const __m128i*)(a + i)),
+                    _mm_loadu_si128((const __m128i*)(b + i)));
+                __m128i e1 = _mm_cmpeq_epi8(
+                    _mm_loadu_si128((const __m128i*)(a + i + 16)),
+                    _mm_loadu_si128((const __m128i*)(b + i + 16)));
+                __m128i e2 = _mm_cmpeq_epi8(
+                    _mm_loadu_si128((const __m128i*)(a + i + 32)),
+                    _mm_loadu_si128((const __m128i*)(b + i + 32)));
+                __m128i e3 = _mm_cmpeq_epi8(
+                    _mm_loadu_si128((const __m128i*)(a + i + 48)),
+                    _mm_loadu_si128((const __m128i*)(b + i + 48)));
+                __m128i all = _mm_and_si128(_mm_and_si128(e0, e1),
+                    _mm_and_si128(e2, e3));
+                if (_mm_movemask_epi8(all) == 0xffff) continue;
+                r.add(i, ~(ut_u32)_mm_movemask_epi8(e0) & 0xffff);
+                r.add(i + 16, ~(ut_u32)_mm_movemask_epi8(e1) & 0xffff);
+                r.add(i + 32, ~(ut_u32)_mm_movemask_epi8(e2) & 0xffff);
+                r.add(i + 48, ~(ut_u32)_mm_movemask_epi8(e3) & 0xffff);
+            }
+            return i;
+        }
+#elif defined(VTEST_SIMD_NEON)
+        static ut_u32 movemask(uint8x16_t ne)
+        {
+            const ut_u8 lanes[16] = { 1, 2, 4, 8, 16, 32, 64, 128,
+                1, 2, 4, 8, 16, 32, 64, 128 };
+            uint8x16_t m = vandq_u8(ne, vld1q_u8(lanes));
+            return vaddv_u8(vget_low_u8(m))
+                | ((ut_u32)vaddv_u8(vget_high_u8(m)) << 8);
+        }
+        static size_t simd_scan(const ut_u8* a, const ut_u8* b, size_t n,
+            ut_buffer_result& r)
+        {
+            size_t i = 0;
+            for (; i + 64 <= n; i += 64) {
+                uint8x16_t e0 = vceqq_u8(vld1q_u8(a + i), vld1q_u8(b + i));
+                uint8x16_t e1 = vceqq_u8(vld1q_u8(a + i + 16), vld1q_u8(b + i + 16));
+                uint8x16_t e2 = vceqq_u8(vld1q_u8(a + i + 32), vld1q_u8(b + i + 32));
+                uint8x16_t e3 = vceqq_u8(vld1q_u8(a + i + 48), vld1q_u8(b + i + 48));
+                uint8x16_t all = vandq_u8(vandq_u8(e0, e1), vandq_u8(e2, e3));
+                if (vminvq_u8(all) == 0xff) continue;
+                r.add(i, movemask(vmvnq_u8(e0)));
+                r.add(i + 16, movemask(vmvnq_u8(e1)));
+                r.add(i + 32, movemask(vmvnq_u8(e2)));
+                r.add(i + 48, movemask(vmvnq_u8(e3)));
+            }
+            return i;
+        }
+#else
+        static size_t simd_scan(const ut_u8*, const ut_u8*, size_t,
+            ut_buffer_result&)
+        {
+            return 0;
+        }
+#endif
+    };
+
+    // read only mapping of a whole file
+    class ut_mapped_file
+    {
+    public:
+        ut_mapped_file(const char* path) : data_(NULL), size_(0), ok_(false)
+        {
+#ifdef VTEST_HAS_MMAP
+            int fd = open(path, O_RDONLY);
+            if (fd < 0) return;
+            struct stat st;
+            if (fstat(fd, &st) == 0) {
+                ok_ = true;
+                size_ = (size_t)st.st_size;
+                if (size_ > 0) {
+                    void* p = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+                    if (p == MAP_FAILED) {
+                        ok_ = false;
+                        size_ = 0;
+                    }
+                    else {
+                        data_ = (const char*)p;
+                        madvise(p, size_, MADV_SEQUENTIAL);
+                    }
+                }
+            }
+            ::close(fd);
+#elif defined(_MSC_VER)
+            file_ = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+            map_ = NULL;
+            if (file_ == INVALID_HANDLE_VALUE) return;
+            LARGE_INTEGER n;
+            if (!GetFileSizeEx(file_, &n)) return;
+            ok_ = true;
+            size_ = (size_t)n.QuadPart;
+            if (size_ > 0) {
+                map_ = CreateFileMappingA(file_, NULL, PAGE_READONLY, 0, 0, NULL);
+                data_ = map_ ? (const char*)MapViewOfFile(map_, FILE_MAP_READ, 0, 0, 0) : NULL;
+                if (data_ == NULL) {
+                    ok_ = false;
+                    size_ = 0;
+                }
+            }
+#else
+            FILE* fp = fopen(path, "rb");
+            if (fp == NULL) return;
+            char buf[65536];
+            size_t n;
+            while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+                copy_.append(buf, n);
+            }
+            fclose(fp);
+            ok_ = true;
+            data_ = copy_.data();
+            size_ = copy_.size();
+#endif
+        }
+        ~ut_mapped_file()
+        {
+            close();
+        }
+        // unmap before the file is replaced, windows refuses it while open
+        void close()
+        {
+#ifdef VTEST_HAS_MMAP
+            if (data_) munmap((void*)data_, size_);
+#elif defined(_MSC_VER)
+            if (data_) UnmapViewOfFile(data_);
+            if (map_) CloseHandle(map_);
+            if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+            map_ = NULL;
+            file_ = INVALID_HANDLE_VALUE;
+#endif
+            data_ = NULL;
+            size_ = 0;
+        }
+        bool ok() const { return ok_; }
+        const char* data() const { return data_; }
+        size_t size() const { return size_; }
+    private:
+        ut_mapped_file(const ut_mapped_file&);
+        ut_mapped_file& operator=(const ut_mapped_file&);
+        const char* data_;
+        size_t size_;
+        bool ok_;
+#ifdef VTEST_HAS_MMAP
+#elif defined(_MSC_VER)
+        HANDLE file_;
+        HANDLE map_;
+#else
+        std::string copy_;
+#endif
+    };
+
+    // streaming compare against a golden file, the output is fed through
+    // write() in pieces of any size and never kept. with --update-golden
+    // the output goes to a temporary file that replaces the golden one by
+    // rename, so a failed run never leaves a half written snapshot
+    class ut_golden
+    {
+    public:
+        ut_golden(const char* path)
+            : path_(path), file_(path), off_(0), diff_(-1), out_(NULL)
+        {
+            update_ = ut_test.get_flag("--update-golden", tmp_);
+            if (update_) {
+                // unique across the threads and the processes of a run
+                char tag[64];
+#ifdef _MSC_VER
+                unsigned long pid = (unsigned long)GetCurrentProcessId();
+#elif defined(VTEST_HAS_MMAP)
+                unsigned long pid = (unsigned long)getpid();
+#else
+                unsigned long pid = (unsigned long)time(NULL);
+#endif
+                snprintf(tag, sizeof(tag), ".tmp%lu.%lu", pid, (unsigned long)
+                    std::hash<std::thread::id>()(std::this_thread::get_id()));
+                tmp_ = path_ + tag;
+                out_ = fopen(tmp_.c_str(), "wb");
+            }
+        }
+        ~ut_golden()
+        {
+            if (out_) {
+                fclose(out_);
+                remove(tmp_.c_str());
+            }
+        }
+        void write(const void* data, size_t n)
+        {
+            const char* p = (const char*)data;
+            if (out_ && fwrite(p, 1, n, out_) != n) {
+                fclose(out_);
+                out_ = NULL;
+                remove(tmp_.c_str());
+            }
+            if (diff_ < 0) {
+                size_t k = off_ < file_.size() ? file_.size() - off_ : 0;
+                if (k > n) k = n;
+                size_t i = first_diff(file_.data() + off_, p, k);
+                if (i < k || (k < n)) {
+                    diff_ = (long long)(off_ + i);
+                    got_.assign(p + i, n - i < SNIPPET ? n - i : SNIPPET);
+                }
+            }
+            off_ += n;
+        }
+        void write(const std::string& s) { write(s.data(), s.size()); }
+        void write(const char* s) { write(s, strlen(s)); }
+        // ends the output, returns false with a report in message
+        bool finish(std::string& message)
+        {
+            char buf[256];
+            if (diff_ < 0 && off_ < file_.size()) {
+                diff_ = (long long)off_;
+            }
+            bool same = file_.ok() && diff_ < 0;
+            if (update_) {
+                if (out_ == NULL) {
+                    message = "can not write " + tmp_;
+                    return false;
+                }
+                int err = fclose(out_);
+                out_ = NULL;
+                if (same || err != 0) {
+                    remove(tmp_.c_str());
+                    if (err != 0) {
+                        message = "can not write " + tmp_;
+                    }
+                    return err == 0;
+                }
+                file_.close();
+                if (!replace(tmp_.c_str(), path_.c_str())) {
+                    remove(tmp_.c_str());
+                    message = "can not replace " + path_;
+                    return false;
+                }
+                ut_cons.set_color_mode_tip();
+                printf("[golden] updated %s, %llu bytes\n", path_.c_str(),
+                    (unsigned long long)off_);
+                ut_cons.reset_color_mode();
+                return true;
+            }
+            if (!file_.ok()) {
+                message = "golden file " + path_ + " not found, run with --update-golden";
+                return false;
+            }
+            if (same) return true;
+            size_t at = (size_t)diff_;
+            size_t line = 1, col = 1;
+            const char* d = file_.data();
+            const char* end = d + (at < file_.size() ? at : file_.size());
+            for (const char* q = d; q < end; ) {
+                const char* nl = (const char*)memchr(q, '\n', end - q);
+                if (nl == NULL) {
+                    col = end - q + 1;
+                    break;
+                }
+                line++;
+                q = nl + 1;
+            }
+            snprintf(buf, sizeof(buf), "golden file %s differs at offset %llu, "
+                "line %llu, column %llu (%llu bytes expected, %llu produced)",
+                path_.c_str(), (unsigned long long)at, (unsigned long long)line,
+                (unsigned long long)col, (unsigned long long)file_.size(),
+                (unsigned long long)off_);
+            message = buf;
+            std::string want;
+            if (at < file_.size()) {
+                want.assign(d + at, file_.size() - at < SNIPPET ? file_.size() - at : SNIPPET);
+            }
+            message += "\n  expected: " + escape(want) + "\n  produced: " + escape(got_);
+            return false;
+        }
+        // the output as one buffer
+        static bool match(const char* path, const void* data, size_t n,
+            std::string& message)
+        {
+            ut_golden g(path);
+            g.write(data, n);
+            return g.finish(message);
+        }
+        static bool match(const char* path, const std::string& s, std::string& message)
+        {
+            return match(path, s.data(), s.size(), message);
+        }
+        static bool match(const char* path, const char* s, std::string& message)
+        {
+            return match(path, s, strlen(s), message);
+        }
+        static bool match(const char* path, const std::vector<char>& v,
+            std::string& message)
+        {
+            return match(path, v.empty() ? NULL : &v[0], v.size(), message);
+        }
+        static bool match(const char* path, const std::vector<unsigned char>& v,
+            std::string& message)
+        {
+            return match(path, v.empty() ? NULL : &v[0], v.size(), message);
+        }
+        // a producer called with the ut_golden to write() the output into
+        template<class P>
+        static bool match(const char* path, P producer, std::string& message)
+        {
+            ut_golden g(path);
+            producer(g);
+            return g.finish(message);
+        }
+    private:
+        static const size_t SNIPPET = 32;
+        static const size_t CHUNK = 1 << 16;
+        // memcmp by chunks, then the byte in the differing chunk
+        static size_t first_diff(const char* a, const char* b, size_t n)
+        {
+            size_t i = 0;
+            for (; i < n; i += CHUNK) {
+                size_t k = n - i < CHUNK ? n - i : CHUNK;
+                if (memcmp(a + i, b + i, k) != 0) {
+                    while (a[i] == b[i]) i++;
+                    return i;
+                }
+            }
+            return n;
+        }
+        static std::string escape(const std::string& s)
+        {
+            std::string r = "\"";
+            char buf[8];
+            for (size_t i = 0; i < s.size(); i++) {
+                unsigned char c = (unsigned char)s[i];
+                if (c == '\n') r += "\\n";
+                else if (c == '\t') r += "\\t";
+                else if (c == '"' || c == '\\') { r += '\\'; r += (char)c; }
+                else if (c < 32 || c >= 127) {
+                    snprintf(buf, sizeof(buf), "\\x%02x", c);
+                    r += buf;
+                }
+                else r += (char)c;
+            }
+            return r + "\"";
+        }
+        static bool replace(const char* from, const char* to)
+        {
+#ifdef _MSC_VER
+            return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+            return rename(from, to) == 0;
+#endif
+        }
+        std::string path_;
+        ut_mapped_file file_;
+        size_t off_;
+        long long diff_;
+        std::string got_;
+        bool update_;
+        std::string tmp_;
+        FILE* out_;
+    };
+
+    class ut_clock
+    {
+    public:
+        static ut_u64 now_ns()
+        {
+            return (ut_u64)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+        }
+    };
+
+    // --trace=file.json writes the run in the trace event format for
+    // perfetto or chrome://tracing. every thread appends to its own buffer
+    // without locks, the buffers are only read when the file is written
+    // after the run. names must outlive the run, string literals or the
+    // names of the registered tests
+    class ut_trace
+    {
+    public:
+        struct event
+        {
+            const char* name;
+            const char* cat;
+            char ph;
+            int line;
+            ut_u64 ts;
+            ut_u64 dur;
+        };
+        static ut_trace& instance()
+        {
+            static ut_trace obj_;
+            return obj_;
+        }
+        bool enabled()
+        {
+            int on = enabled_.load(std::memory_order_relaxed);
+            if (on < 0) {
+                std::string v;
+                on = ut_test.get_option("--trace=", v) ? 1 : 0;
+                enabled_.store(on);
+            }
+            return on == 1;
+        }
+        void span(const char* name, const char* cat, ut_u64 begin, ut_u64 end)
+        {
+            push(name, cat, 'X', 0, begin, end - begin);
+        }
+        // a span that does not belong to one thread, shown as async
+        void async(const char* name, const char* cat, ut_u64 begin, ut_u64 end)
+        {
+            push(name, cat, 'b', 0, begin, end - begin);
+        }
+        void mark(const char* name, const char* cat, int line)
+        {
+            push(name, cat, 'i', line, ut_clock::now_ns(), 0);
+        }
+        // a copy of a name that lives until the trace is written
+        const char* intern(const char* s)
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            return names_.insert(s).first->c_str();
+        }
+        // the label of the calling thread on the timeline
+        void name_thread(const char* label, int index)
+        {
+            if (!enabled()) return;
+            buffer* b = local();
+            b->label = label;
+            b->index = index;
+        }
+        // an async test ends on the loop thread, the span is its time
+        // back from the end
+        static void hook(unit_test::test_node& t, bool begin)
+        {
+            ut_trace& tr = instance();
+            if (!tr.enabled()) return;
+            if (begin) {
+                tr.local()->label = "test worker";
+                return;
+            }
+            ut_u64 now = ut_clock::now_ns();
+            ut_u64 ns = (ut_u64)(t.ms * 1e6);
+            tr.span(tr.intern(t.fi.func.c_str()), t.fi.first ? "fixture" : "test",
+                ns < now ? now - ns : 0, now);
+        }
+        static void on_fail(const char* fn, int line)
+        {
+            ut_trace& tr = instance();
+            if (!tr.enabled()) return;
+            tr.mark(tr.intern(fn), "failure", line);
+        }
+        static void report()
+        {
+            std::string path;
+            if (!instance().enabled() || !ut_test.get_option("--trace=", path)) return;
+            instance().write(path);
+        }
+    private:
+        struct buffer
+        {
+            int tid;
+            const char* label;
+            int index;
+            std::vector<event> events;
+        };
+        ut_trace() : enabled_(-1), origin_(ut_clock::now_ns())
+        {
+            ut_test.add_hook(hook);
+            ut_test.add_fail_hook(on_fail);
+            ut_test.add_report(report);
+        }
+        ~ut_trace()
+        {
+            for (size_t i = 0; i < buffers_.size(); i++) {
+                delete buffers_[i];
+            }
+        }
+        void push(const char* name, const char* cat, char ph, int line,
+            ut_u64 ts, ut_u64 dur)
+        {
+            if (!enabled()) return;
+            ut_alloc_pause quiet;
+            event e = { name, cat, ph, line, ts, dur };
+            local()->events.push_back(e);
+        }
+        buffer* local()
+        {
+            static thread_local buffer* obj_ = NULL;
+            if (obj_ == NULL) {
+                obj_ = new buffer();
+                obj_->label = "thread";
+                std::lock_guard<std::mutex> guard(lock_);
+                obj_->tid = (int)buffers_.size() + 1;
+                obj_->index = obj_->tid;
+                buffers_.push_back(obj_);
+            }
+            return obj_;
+        }
+        static std::string escape(const char* s)
+        {
+            std::string r;
+            for (; *s; s++) {
+                if (*s == '"' || *s == '\\') r += '\\';
+                if ((unsigned char)*s >= 32) r += *s;
+            }
+            return r;
+        }
+        void write(const std::string& path)
+        {
+            FILE* fp = fopen(path.c_str(), "w");
+            if (fp == NULL) {
+                printf("Can not write trace %s\n", path.c_str());
+                return;
+            }
+            std::lock_guard<std::mutex> guard(lock_);
+            fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+            fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+                "\"args\":{\"name\":\"vtest\"}}");
+            int async_id = 0;
+            for (size_t i = 0; i < buffers_.size(); i++) {
+                const buffer& b = *buffers_[i];
+                fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+                    "\"tid\":%d,\"args\":{\"name\":\"%s %d\"}}", b.tid,
+                    escape(b.label).c_str(), b.index);
+                for (size_t k = 0; k < b.events.size(); k++) {
+                    const event& e = b.events[k];
+                    double ts = (double)(e.ts - origin_) / 1000.0;
+                    std::string name = escape(e.name);
+                    if (e.ph == 'X') {
+                        fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+                            "\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                            name.c_str(), e.cat, b.tid, ts, e.dur / 1000.0);
+                    }
+                    else if (e.ph == 'b') {
+                        async_id++;
+                        fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"b\","
+                            "\"id\":%d,\"pid\":1,\"tid\":%d,\"ts\":%.3f}",
+                            name.c_str(), e.cat, async_id, b.tid, ts);
+                        fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"e\","
+                            "\"id\":%d,\"pid\":1,\"tid\":%d,\"ts\":%.3f}",
+                            name.c_str(), e.cat, async_id, b.tid, ts + e.dur / 1000.0);
+                    }
+                    else {
+                        fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"i\","
+                            "\"s\":\"t\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,"
+                            "\"args\":{\"line\":%d}}",
+                            name.c_str(), e.cat, b.tid, ts, e.line);
+                    }
+                }
+            }
+            fprintf(fp, "\n]}\n");
+            fclose(fp);
+            printf("Trace written to %s\n", path.c_str());
+        }
+        std::atomic<int> enabled_;
+        ut_u64 origin_;
+        std::mutex lock_;
+        std::vector<buffer*> buffers_;
+        std::set<std::string> names_;
+    };
+    static ut_trace& ut_tracer = ut_trace::instance();
+
+    // a span of the enclosing block on the trace, see VTEST_TRACE_SCOPE
+    class ut_trace_scope
+    {
+    public:
+        ut_trace_scope(const char* name)
+            : name_(name), begin_(ut_tracer.enabled() ? ut_clock::now_ns() : 0)
+        {}
+        ~ut_trace_scope()
+        {
+            if (begin_) ut_tracer.span(name_, "scope", begin_, ut_clock::now_ns());
+        }
+    private:
+        const char* name_;
+        ut_u64 begin_;
+    };
+
+    // splitmix64, small and good enough for test data
+    class ut_rand
+    {
+    public:
+        ut_rand(ut_u64 seed = 0) : s_(seed) {}
+        void seed(ut_u64 seed) { s_ = seed; }
+        ut_u64 next()
+        {
+            ut_u64 z = (s_ += 0x9e3779b97f4a7c15ULL);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            return z ^ (z >> 31);
+        }
+        ut_u64 next(ut_u64 n) { return n ? next() % n : 0; }
+        double next_double() { return (next() >> 11) * (1.0 / 9007199254740992.0); }
+        static ut_u64 hash(const char* s)
+        {
+            return unit_test::name_hash(s);
+        }
+    private:
+        ut_u64 s_;
+    };
+
+    // lazy parameter generators for BAT_CHECK_N / VBAT_CHECK_N. they have
+    // size() and operator[] like ut_vars, but build the case of an index
+    // on demand into one cached row, so memory does not grow with the
+    // number of cases and the index stays the case number of the report
+
+    // the values of one parameter, a half open range or a list
+    class ut_domain
+    {
+    public:
+        ut_domain() : lo_(0), step_(1), n_(0) {}
+        ut_domain(const std::vector<ut_var>& values)
+            : lo_(0), step_(1), n_(values.size()), values_(values)
+        {}
+        ut_domain(std::initializer_list<ut_var> values)
+            : lo_(0), step_(1), n_(values.size()), values_(values)
+        {}
+        static ut_domain range(ut_i64 lo, ut_i64 hi, ut_i64 step = 1)
+        {
+            ut_domain d;
+            d.lo_ = lo;
+            d.step_ = step != 0 ? step : 1;
+            ut_i64 span = d.step_ > 0 ? hi - lo : lo - hi;
+            ut_i64 s = d.step_ > 0 ? d.step_ : -d.step_;
+            d.n_ = span > 0 ? (size_t)((span + s - 1) / s) : 0;
+            return d;
+        }
+        size_t size() const { return n_; }
+        // ranges give ut_i32 values when they fit, ut_i64 otherwise
+        ut_var at(size_t i) const
+        {
+            if (!values_.empty()) return values_[i];
+            ut_i64 v = lo_ + (ut_i64)i * step_;
+            if (v >= -2147483647LL - 1 && v <= 2147483647LL) return ut_var((ut_i32)v);
+            return ut_var(v);
+        }
+    private:
+        ut_i64 lo_;
+        ut_i64 step_;
+        size_t n_;
+        std::vector<ut_var> values_;
+    };
+
+    // every combination, case i is i written in the mixed radix of the
+    // domain sizes with the last parameter changing fastest
+    class ut_gen_product
+    {
+    public:
+        ut_gen_product(std::initializer_list<ut_domain> domains)
+            : domains_(domains)
+        {
+            init();
+        }
+        ut_gen_product(const std::vector<ut_domain>& domains)
+            : domains_(domains)
+        {
+            init();
+        }
+        size_t size() const { return n_; }
+        std::vector<ut_var>& operator[](size_t i) const
+        {
+            for (size_t k = domains_.size(); k > 0; k--) {
+                size_t d = domains_[k - 1].size();
+                row_[k - 1] = domains_[k - 1].at(i % d);
+                i /= d;
+            }
+            return row_;
+        }
+    private:
+        void init()
+        {
+            n_ = domains_.empty() ? 0 : 1;
+            for (size_t k = 0; k < domains_.size(); k++) {
+                size_t d = domains_[k].size();
+                if (d != 0 && n_ > (size_t)-1 / d) {
+                    printf("ut_gen_product: too many cases, truncated\n");
+                    n_ = (size_t)-1;
+                    break;
+                }
+                n_ *= d;
+            }
+            row_.resize(domains_.size());
+        }
+        std::vector<ut_domain> domains_;
+        size_t n_;
+        mutable std::vector<ut_var> row_;
+    };
+
+    // all pairs, every two values of any two parameters meet in at least
+    // one case. built greedily once, only the value indexes are kept
+    class ut_gen_pairwise
+    {
+    public:
+        ut_gen_pairwise(std::initializer_list<ut_domain> domains)
+            : domains_(domains)
+        {
+            build();
+        }
+        ut_gen_pairwise(const std::vector<ut_domain>& domains)
+            : domains_(domains)
+        {
+            build();
+        }
+        size_t size() const { return cases_.size() / (domains_.empty() ? 1 : domains_.size()); }
+        std::vector<ut_var>& operator[](size_t i) const
+        {
+            size_t m = domains_.size();
+            for (size_t k = 0; k < m; k++) {
+                row_[k] = domains_[k].at(cases_[i * m + k]);
+            }
+            return row_;
+        }
+    private:
+        // covered[a][b] has one flag per value pair of parameters a < b
+        void build()
+        {
+            size_t m = domains_.size();
+            row_.resize(m);
+            for (size_t k = 0; k < m; k++) {
+                if (domains_[k].size() == 0) return;
+            }
+            if (m == 1) {
+                for (size_t v = 0; v < domains_[0].size(); v++) {
+                    cases_.push_back((ut_u32)v);
+                }
+                return;
+            }
+            std::vector<std::vector<std::vector<char> > > covered(m,
+                std::vector<std::vector<char> >(m));
+            size_t left = 0;
+            for (size_t a = 0; a < m; a++) {
+                for (size_t b = a + 1; b < m; b++) {
+                    covered[a][b].assign(domains_[a].size() * domains_[b].size(), 0);
+                    left += covered[a][b].size();
+                }
+            }
+            std::vector<ut_u32> c(m);
+            std::vector<char> fixed(m);
+            while (left > 0) {
+                // seed the case with the first uncovered pair
+                size_t a = 0, b = 1, p = 0;
+                for (a = 0; a < m; a++) {
+                    for (b = a + 1; b < m; b++) {
+                        std::vector<char>& f = covered[a][b];
+                        p = std::find(f.begin(), f.end(), 0) - f.begin();
+                        if (p < f.size()) break;
+                    }
+                    if (b < m) break;
+                }
+                std::fill(fixed.begin(), fixed.end(), 0);
+                c[a] = (ut_u32)(p / domains_[b].size());
+                c[b] = (ut_u32)(p % domains_[b].size());
+                fixed[a] = fixed[b] = 1;
+                // the other values cover the most new pairs with the fixed ones
+                for (size_t k = 0; k < m; k++) {
+                    if (fixed[k]) continue;
+                    size_t best = 0, gain = 0;
+                    for (size_t v = 0; v < domains_[k].size(); v++) {
+                        size_t g = 0;
+                        for (size_t j = 0; j < m; j++) {
+                            if (fixed[j] && !pair_covered(covered, j, c[j], k, v)) g++;
+                        }
+                        if (g > gain) {
+                            gain = g;
+                            best = v;
+                        }
+                    }
+                    c[k] = (ut_u32)best;
+                    fixed[k] = 1;
+                }
+                for (size_t x = 0; x < m; x++) {
+                    for (size_t y = x + 1; y < m; y++) {
+                        char& f = covered[x][y][c[x] * domains_[y].size() + c[y]];
+                        if (f == 0) {
+                            f = 1;
+                            left--;
+                        }
+                    }
+                }
+                cases_.insert(cases_.end(), c.begin(), c.end());
+            }
+        }
+        bool pair_covered(const std::vector<std::vector<std::vector<char> > >& covered,
+            size_t j, size_t vj, size_t k, size_t vk) const
+        {
+            if (j < k) return covered[j][k][vj * domains_[k].size() + vk] != 0;
+            return covered[k][j][vk * domains_[j].size() + vj] != 0;
+        }
+        std::vector<ut_domain> domains_;
+        std::vector<ut_u32> cases_;
+        mutable std::vector<ut_var> row_;
+    };
+
+    // n cases drawn from another generator, case i always maps to the same
+    // case of the source for a given seed
+    template<class G>
+    class ut_gen_sample
+    {
+    public:
+        ut_gen_sample(const G& source, size_t n, ut_u64 seed = 0)
+            : source_(source), n_(source.size() ? n : 0), seed_(seed)
+        {}
+        size_t size() const { return n_; }
+        std::vector<ut_var>& operator[](size_t i) const
+        {
+            ut_rand r(seed_ + i);
+            return source_[(size_t)r.next(source_.size())];
+        }
+    private:
+        G source_;
+        size_t n_;
+        ut_u64 seed_;
+    };
+
+    template<class G>
+    ut_gen_sample<G> ut_sample(const G& source, size_t n, ut_u64 seed = 0)
+    {
+        return ut_gen_sample<G>(source, n, seed);
+    }
+
+    // make the compiler believe the value is read, a benchmark body whose
+    // result is never used is otherwise removed at -O2
+    template<class T>
+    inline void ut_do_not_optimize(const T& value)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        asm volatile("" : : "r,m"(value) : "memory");
+#else
+        static const volatile void* volatile sink;
+        sink = &value;
+#endif
+    }
+
+    // make the compiler believe any memory may be read or written here
+    inline void ut_clobber_memory()
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        asm volatile("" : : : "memory");
+#else
+        _ReadWriteBarrier();
+#endif
+    }
+
+    // per thread state of a VTEST_STRESS body, loop with while (ctx.next())
+    class ut_stress_ctx
+    {
+    public:
+        ut_stress_ctx(int index, int threads, ut_u64 iterations,
+            ut_u64 deadline, ut_u64 seed)
+            : index_(index), threads_(threads), iterations_(iterations),
+            deadline_(deadline), ops_(0), rand_(seed), cold_(NULL),
+            cold_size_(0), paused_(0), range_(0), begin_(0)
+        {}
+        int index() const { return index_; }
+        int threads() const { return threads_; }
+        ut_u64 ops() const { return ops_; }
+        ut_rand& rand() { return rand_; }
+        // input size of a VTEST_BENCH_RANGE body
+        ut_u64 range() const { return range_; }
+        void set_range(ut_u64 n) { range_ = n; }
+        // leave the setup before the loop out of the measurement
+        void reset_timer() { begin_ = ut_clock::now_ns(); }
+        void set_begin(ut_u64 t) { begin_ = t; }
+        ut_u64 begin() const { return begin_; }
+        // time spent evicting the caches, not part of the measurement
+        ut_u64 paused() const { return paused_; }
+        void set_cold(char* buf, size_t size)
+        {
+            cold_ = buf;
+            cold_size_ = size;
+        }
+        bool next()
+        {
+            if (deadline_ == 0) {
+                if (ops_ >= iterations_) return false;
+            }
+            else if ((ops_ & 63) == 0 && ut_clock::now_ns() >= deadline_) {
+                return false;
+            }
+            // once per repetition, after the setup of the body
+            if (cold_ && ops_ == 0) {
+                evict();
+            }
+            ops_++;
+            return true;
+        }
+    private:
+        // write a buffer larger than the last level cache, the repetition
+        // starts with the data of the body evicted
+        void evict()
+        {
+            ut_u64 t0 = ut_clock::now_ns();
+            volatile char* p = cold_;
+            for (size_t i = 0; i < cold_size_; i += 64) {
+                p[i] = (char)(p[i] + 1);
+            }
+            paused_ += ut_clock::now_ns() - t0;
+        }
+        int index_;
+        int threads_;
+        ut_u64 iterations_;
+        ut_u64 deadline_;
+        ut_u64 ops_;
+        ut_rand rand_;
+        char* cold_;
+        size_t cold_size_;
+        ut_u64 paused_;
+        ut_u64 range_;
+        ut_u64 begin_;
+    };
+
+    // options of the benchmark runner
+    //   --bench-cpus=0,2-3  pin the benchmark threads round robin (linux)
+    //   --bench-cold[=MB]   evict the caches before each repetition (32 MB)
+    //   --bench-reps=5      repetitions of a VTEST_BENCH, reported with cv
+    //   --bench-cv=5        cv in percent above which a bench is unstable
+    //   --bench-retry=2     reruns of an unstable bench, the best one counts
+    class ut_bench_env
+    {
+    public:
+        static int option(const char* key, int def)
+        {
+            std::string v;
+            return ut_test.get_option(key, v) && !v.empty() ? atoi(v.c_str()) : def;
+        }
+        static size_t cold_bytes()
+        {
+            std::string v;
+            if (!ut_test.get_flag("--bench-cold", v)) return 0;
+            int mb = v.empty() ? 32 : atoi(v.c_str());
+            return (size_t)(mb > 0 ? mb : 32) << 20;
+        }
+        static const std::vector<int>& cpus()
+        {
+            static std::vector<int> obj_ = parse_cpus();
+            return obj_;
+        }
+        static void pin(int index)
+        {
+#ifdef VTEST_HAS_AFFINITY
+            const std::vector<int>& c = cpus();
+            if (c.empty()) return;
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(c[index % c.size()], &set);
+            sched_setaffinity(0, sizeof(set), &set);
+#else
+            (void)index;
+#endif
+        }
+        // coefficient of variation, stddev / mean
+        static double cv(const std::vector<double>& v)
+        {
+            if (v.size() < 2) return 0;
+            double mean = 0, var = 0;
+            for (size_t i = 0; i < v.size(); i++) mean += v[i];
+            mean /= v.size();
+            for (size_t i = 0; i < v.size(); i++) var += (v[i] - mean) * (v[i] - mean);
+            var /= v.size() - 1;
+            return mean > 0 ? sqrt(var) / mean : 0;
+        }
+        // warn once per run about what makes the numbers noisy
+        static void check_noise()
+        {
+            static bool checked = false;
+            if (checked) return;
+            checked = true;
+            std::vector<std::string> w;
+            char buf[64];
+            int ncpu = (int)std::thread::hardware_concurrency();
+            if (ut_test.jobs() > 1) {
+                w.push_back("other tests run concurrently with --jobs");
+            }
+#ifdef __linux__
+            double load = 0;
+            if (read_file("/proc/loadavg", buf, sizeof(buf))) {
+                load = atof(buf);
+            }
+            if (ncpu > 0 && load > ncpu * 0.5) {
+                snprintf(buf, sizeof(buf), "load average %.2f on %d cpus", load, ncpu);
+                w.push_back(buf);
+            }
+            char path[128];
+            snprintf(path, sizeof(path),
+                "/sys/devices/system/cpu/cpu%d/cpufreq/scaling_governor",
+                cpus().empty() ? 0 : cpus()[0]);
+            if (read_file(path, buf, sizeof(buf)) && strncmp(buf, "performance", 11) != 0) {
+                w.push_back(std::string("cpu frequency governor is ") + buf);
+            }
+            if (read_file("/sys/devices/system/cpu/intel_pstate/no_turbo", buf, sizeof(buf))
+                && buf[0] == '0') {
+                w.push_back("turbo boost is enabled");
+            }
+            if (read_file("/sys/devices/system/cpu/cpufreq/boost", buf, sizeof(buf))
+                && buf[0] == '1') {
+                w.push_back("cpu boost is enabled");
+            }
+            if (cpus().empty()) {
+                w.push_back("threads are not pinned, see --bench-cpus");
+            }
+#endif
+            if (w.empty()) return;
+            ut_cons.set_color_mode_tip();
+            for (size_t i = 0; i < w.size(); i++) {
+                printf("[bench] warning: %s\n", w[i].c_str());
+            }
+            ut_cons.reset_color_mode();
+        }
+    private:
+        static std::vector<int> parse_cpus()
+        {
+            std::vector<int> c;
+            std::string v;
+            if (!ut_test.get_option("--bench-cpus=", v)) return c;
+            const char* p = v.c_str();
+            while (*p) {
+                char* end;
+                int a = (int)strtol(p, &end, 10), b = a;
+                if (end == p) break;
+                p = end;
+                if (*p == '-') {
+                    b = (int)strtol(p + 1, &end, 10);
+                    p = end;
+                }
+                for (int i = a; i <= b; i++) c.push_back(i);
+                if (*p == ',') p++;
+            }
+            return c;
+        }
+        static bool read_file(const char* path, char* buf, size_t n)
+        {
+            FILE* fp = fopen(path, "r");
+            if (fp == NULL) return false;
+            bool ok = fgets(buf, (int)n, fp) != NULL;
+            fclose(fp);
+            if (ok) buf[strcspn(buf, "\n")] = 0;
+            return ok;
+        }
+    };
+
+    // least squares fit of time = coef * f(n) without intercept for the
+    // usual models, the errors are relative to the time so every size
+    // counts the same and the largest n does not decide alone. the model
+    // with the smallest relative rms error wins
+    class ut_complexity
+    {
+    public:
+        enum { O_1, O_LOGN, O_N, O_NLOGN, O_N2, MODELS };
+        struct expect
+        {
+            int model;
+            const char* file;
+            int line;
+        };
+        static const char* name(int model)
+        {
+            static const char* names[] = { "O(1)", "O(log n)", "O(n)",
+                "O(n log n)", "O(n^2)" };
+            return model >= 0 && model < MODELS ? names[model] : "O(?)";
+        }
+        static double f(int model, double n)
+        {
+            double lg = n > 1 ? log(n) / log(2.0) : 1;
+            switch (model) {
+            case O_1: return 1;
+            case O_LOGN: return lg;
+            case O_N: return n;
+            case O_NLOGN: return n * lg;
+            default: return n * n;
+            }
+        }
+        static int fit(const std::vector<double>& n, const std::vector<double>& t,
+            double& coef, double& rms)
+        {
+            int best = O_1;
+            coef = 0;
+            rms = -1;
+            size_t k = 0;
+            for (size_t i = 0; i < t.size(); i++) {
+                if (t[i] > 0) k++;
+            }
+            if (k == 0) return best;
+            for (int m = 0; m < MODELS; m++) {
+                // minimizes the sum of ((t - c f) / t)^2
+                double ff = 0, tf = 0, err = 0;
+                for (size_t i = 0; i < n.size(); i++) {
+                    if (t[i] <= 0) continue;
+                    double g = f(m, n[i]) / t[i];
+                    ff += g * g;
+                    tf += g;
+                }
+                double c = tf / ff;
+                for (size_t i = 0; i < n.size(); i++) {
+                    if (t[i] <= 0) continue;
+                    double d = 1 - c * f(m, n[i]) / t[i];
+                    err += d * d;
+                }
+                double r = sqrt(err / k);
+                if (rms < 0 || r < rms) {
+                    best = m;
+                    coef = c;
+                    rms = r;
+                }
+            }
+            return best;
+        }
+        static std::map<std::string, expect>& expects()
+        {
+            static std::map<std::string, expect> obj_;
+            return obj_;
+        }
+    };
+
+    class ut_stress
+    {
+    public:
+        typedef void(*STRESS_PROC)(ut_stress_ctx&);
+        struct result
+        {
+            int threads;
+            ut_u64 ops;
+            double seconds;
+            std::vector<ut_u64> thread_ops;
+            std::vector<double> thread_seconds;
+        };
+        // run body on threads, all released together from a barrier, the
+        // loop is bounded by iterations per thread or by ms when ms > 0.
+        // bench runs are pinned, may evict the caches and are timed by the
+        // threads from ctx.reset_timer(), stress runs by the wall clock
+        static result run(const char* name, STRESS_PROC body, int threads,
+            ut_u64 iterations, ut_u64 ms, bool bench, ut_u64 range = 0)
+        {
+            if (threads <= 0) {
+                threads = (int)std::thread::hardware_concurrency();
+                if (threads <= 0) threads = 1;
+            }
+            result r;
+            r.threads = threads;
+            r.thread_ops.assign(threads, 0);
+            r.thread_seconds.assign(threads, 0);
+            std::atomic<int> ready(0);
+            std::atomic<ut_u64> start(0);
+            std::vector<std::thread> pool;
+            ut_u64 seed = ut_rand::hash(name);
+            unit_test::test_node* test = unit_test::current_test();
+            for (int i = 0; i < threads; i++) {
+                pool.push_back(std::thread(worker, name, body, i, threads, iterations,
+                    ms, bench, range, seed + i, test, &ready, &start, &r));
+            }
+            while (ready.load() < threads) {
+                std::this_thread::yield();
+            }
+            ut_u64 t0 = ut_clock::now_ns();
+            start.store(t0);
+            for (int i = 0; i < threads; i++) {
+                pool[i].join();
+            }
+            r.seconds = (ut_clock::now_ns() - t0) / 1e9;
+            r.ops = 0;
+            for (int i = 0; i < threads; i++) {
+                r.ops += r.thread_ops[i];
+            }
+            // the threads ran without the setup and the eviction time
+            if (bench) {
+                r.seconds = *std::max_element(r.thread_seconds.begin(),
+                    r.thread_seconds.end());
+            }
+            return r;
+        }
+        static void show(const char* name, const result& r)
+        {
+            ut_cons.set_color_mode_tip();
+            printf("[stress] %s: %d threads, %llu ops in %.3f s, %.0f ops/s\n",
+                name, r.threads, (unsigned long long)r.ops, r.seconds,
+                rate(r.ops, r.seconds));
+            for (int i = 0; i < r.threads; i++) {
+                printf("  thread %d: %llu ops, %.0f ops/s\n", i,
+                    (unsigned long long)r.thread_ops[i],
+                    rate(r.thread_ops[i], r.thread_seconds[i]));
+            }
+            ut_cons.reset_color_mode();
+        }
+        static double rate(ut_u64 ops, double seconds)
+        {
+            return seconds > 0 ? ops / seconds : 0;
+        }
+        // entry of VTEST_STRESS, sweep the thread count in --scale mode or
+        // when an efficiency is expected for the test
+        static void exec(const char* name, STRESS_PROC body, int threads,
+            ut_u64 iterations, ut_u64 ms)
+        {
+            if (ut_test.scale() != 0 || expects().count(name) > 0) {
+                sweep(name, body, iterations, ms, false);
+            }
+            else {
+                show(name, run(name, body, threads, iterations, ms, false));
+            }
+        }
+        // entry of VTEST_BENCH, one thread unless in --scale mode. the run
+        // is repeated and rerun while the ns/op vary more than --bench-cv
+        static void bench(const char* name, STRESS_PROC body, ut_u64 iterations)
+        {
+            if (ut_test.scale() != 0 || expects().count(name) > 0) {
+                sweep(name, body, iterations, 0, true);
+                return;
+            }
+            ut_bench_env::check_noise();
+            int reps = ut_bench_env::option("--bench-reps=", 5);
+            int retry = ut_bench_env::option("--bench-retry=", 2);
+            double limit = ut_bench_env::option("--bench-cv=", 5) / 100.0;
+            if (reps < 1) reps = 1;
+            std::vector<double> best;
+            double best_cv = -1;
+            // warm up, the first run pays for page faults and lazy setup
+            run(name, body, 1, iterations, 0, true);
+            for (int a = 0; a <= retry; a++) {
+                std::vector<double> ns;
+                for (int i = 0; i < reps; i++) {
+                    result r = run(name, body, 1, iterations, 0, true);
+                    ns.push_back(r.ops ? r.seconds * 1e9 / r.ops : 0);
+                }
+                double cv = ut_bench_env::cv(ns);
+                if (best_cv < 0 || cv < best_cv) {
+                    best = ns;
+                    best_cv = cv;
+                }
+                if (cv <= limit) break;
+                if (a < retry) {
+                    ut_cons.set_color_mode_tip();
+                    printf("[bench] %s: cv %.1f%% above %.1f%%, retry\n", name,
+                        cv * 100, limit * 100);
+                    ut_cons.reset_color_mode();
+                }
+            }
+            std::sort(best.begin(), best.end());
+            size_t mid = best.size() / 2;
+            double median = best.size() % 2 ? best[mid] : (best[mid - 1] + best[mid]) / 2;
+            ut_cons.set_color_mode_tip();
+            printf("[bench] %s: %d x %llu ops, median %.2f ns/op, min %.2f, cv %.1f%%%s\n",
+                name, reps, (unsigned long long)iterations, median,
+                best[0], best_cv * 100, best_cv > limit ? ", unstable" : "");
+            ut_cons.reset_color_mode();
+        }
+        // run at 1, 2, 4, ... threads up to the hardware threads (or the
+        // --scale=n limit) plus every thread count with an expectation,
+        // each thread does the same work so ideal scaling keeps ops/s
+        // growing linearly
+        static void sweep(const char* name, STRESS_PROC body,
+            ut_u64 iterations, ut_u64 ms, bool bench)
+        {
+            int top = ut_test.scale();
+            if (top <= 0) {
+                top = (int)std::thread::hardware_concurrency();
+                if (top <= 0) top = 1;
+            }
+            std::vector<int> counts;
+            for (int t = 1; t < top; t *= 2) {
+                counts.push_back(t);
+            }
+            counts.push_back(top);
+            std::vector<expect>& exp = expects()[name];
+            for (size_t i = 0; i < exp.size(); i++) {
+                counts.push_back(exp[i].threads);
+            }
+            std::sort(counts.begin(), counts.end());
+            counts.erase(std::unique(counts.begin(), counts.end()), counts.end());
+            ut_cons.set_color_mode_tip();
+            printf("[scaling] %s\n", name);
+            printf("  threads          ops/s   speedup  efficiency\n");
+            ut_cons.reset_color_mode();
+            std::map<int, double> eff;
+            double base = 0;
+            for (size_t i = 0; i < counts.size(); i++) {
+                result r = run(name, body, counts[i], iterations, ms, bench);
+                double ops = rate(r.ops, r.seconds);
+                if (counts[i] == 1) base = ops;
+                double speedup = base > 0 ? ops / base : 0;
+                eff[counts[i]] = speedup / counts[i];
+                ut_cons.set_color_mode_tip();
+                printf("  %7d %14.0f %9.2f %10.1f%%\n", counts[i], ops,
+                    speedup, eff[counts[i]] * 100);
+                ut_cons.reset_color_mode();
+            }
+            for (size_t i = 0; i < exp.size(); i++) {
+                bool eq = eff[exp[i].threads] >= exp[i].efficiency;
+                if (eq == false) {
+                    ut_cons.set_color_mode_tip();
+                    printf("Expect: efficiency >= %.1f%% at %d threads, "
+                        "Return Value: %.1f%%\n", exp[i].efficiency * 100,
+                        exp[i].threads, eff[exp[i].threads] * 100);
+                    ut_cons.reset_color_mode();
+                }
+                ut_test.check_eq(eq, name, exp[i].line, exp[i].file, exp[i].threads);
+            }
+        }
+        static void add_expect(const char* name, int threads,
+            double efficiency, const char* file, int line)
+        {
+            expect e = { threads, efficiency, file, line };
+            expects()[name].push_back(e);
+        }
+        // entry of VTEST_BENCH_RANGE, one thread at sizes lo, 2 lo, ... hi,
+        // each size repeated until it runs --bench-min-ms (10), then the
+        // times are fitted to the complexity models
+        static void bench_range(const char* name, STRESS_PROC body,
+            ut_u64 lo, ut_u64 hi)
+        {
+            ut_bench_env::check_noise();
+            double min_s = ut_bench_env::option("--bench-min-ms=", 10) / 1000.0;
+            std::vector<double> ns, t;
+            ut_cons.set_color_mode_tip();
+            printf("[bench] %s\n", name);
+            printf("  %12s %14s %12s\n", "n", "ns/op", "ns/n");
+            ut_cons.reset_color_mode();
+            for (ut_u64 n = lo ? lo : 1; n <= hi; n *= 2) {
+                ut_u64 iterations = 1;
+                result r;
+                for (;;) {
+                    r = run(name, body, 1, iterations, 0, true, n);
+                    double s = r.thread_seconds[0];
+                    if (s >= min_s || iterations >= ((ut_u64)1 << 40)) break;
+                    double grow = s > 0 ? min_s / s * 1.2 : 100;
+                    iterations = (ut_u64)(iterations * (grow < 2 ? 2 : grow > 100 ? 100 : grow));
+                }
+                double op = r.ops ? r.thread_seconds[0] * 1e9 / r.ops : 0;
+                ns.push_back((double)n);
+                t.push_back(op);
+                ut_cons.set_color_mode_tip();
+                printf("  %12llu %14.2f %12.4f\n", (unsigned long long)n, op, op / n);
+                ut_cons.reset_color_mode();
+                if (n > hi / 2) break;
+            }
+            double coef = 0, rms = 0;
+            int best = ut_complexity::fit(ns, t, coef, rms);
+            ut_cons.set_color_mode_tip();
+            printf("  best fit %s, coefficient %.4g ns, rms %.1f%%\n",
+                ut_complexity::name(best), coef, rms * 100);
+            ut_cons.reset_color_mode();
+            std::map<std::string, ut_complexity::expect>::iterator it
+                = ut_complexity::expects().find(name);
+            if (it != ut_complexity::expects().end()) {
+                bool eq = best <= it->second.model;
+                if (eq == false) {
+                    ut_cons.set_color_mode_tip();
+                    printf("Expect: %s or better, Return Value: %s\n",
+                        ut_complexity::name(it->second.model), ut_complexity::name(best));
+                    ut_cons.reset_color_mode();
+                }
+                ut_test.check_eq(eq, name, it->second.line, it->second.file, 0);
+            }
+        }
+    private:
+        struct expect
+        {
+            int threads;
+            double efficiency;
+            const char* file;
+            int line;
+        };
+        static std::map<std::string, std::vector<expect> >& expects()
+        {
+            static std::map<std::string, std::vector<expect> > obj_;
+            return obj_;
+        }
+        static void worker(const char* name, STRESS_PROC body, int index, int threads,
+            ut_u64 iterations, ut_u64 ms, bool bench, ut_u64 range, ut_u64 seed,
+            unit_test::test_node* test, std::atomic<int>* ready,
+            std::atomic<ut_u64>* start, result* r)
+        {
+            unit_test::current_test() = test;
+            if (bench) ut_bench_env::pin(index);
+            std::vector<char> cold(bench ? ut_bench_env::cold_bytes() : 0, 0);
+            ready->fetch_add(1);
+            ut_u64 t0;
+            while ((t0 = start->load()) == 0) {
+                std::this_thread::yield();
+            }
+            ut_stress_ctx ctx(index, threads, iterations,
+                ms > 0 ? t0 + ms * 1000000 : 0, seed);
+            if (!cold.empty()) {
+                ctx.set_cold(&cold[0], cold.size());
+            }
+            ctx.set_range(range);
+            ctx.set_begin(t0);
+            body(ctx);
+            if (ut_tracer.enabled()) {
+                ut_tracer.name_thread(name, index);
+                ut_tracer.span(name, threads > 1 ? "stress" : "bench", t0,
+                    ut_clock::now_ns());
+            }
+            r->thread_seconds[index] = (ut_clock::now_ns() - ctx.begin()
+                - ctx.paused()) / 1e9;
+            r->thread_ops[index] = ctx.ops();
+        }
+    };
+
+    class ut_complexity_holder
+    {
+    public:
+        ut_complexity_holder(const char* name, int model, const char* file, int line)
+        {
+            ut_complexity::expect e = { model, file, line };
+            ut_complexity::expects()[name] = e;
+        }
+    };
+
+    class ut_scaling_holder
+    {
+    public:
+        ut_scaling_holder(const char* name, int threads, double efficiency,
+            const char* file, int line)
+        {
+            ut_stress::add_expect(name, threads, efficiency, file, line);
         }
-        bool operator== (const bool v) const
+    };
+
+#ifdef VTEST_HAS_COROUTINE
+    // resumes a suspended coroutine on the loop, wake() may be called from
+    // any thread
+    struct ut_waker
+    {
+        std::coroutine_handle<> h;
+        int root;
+        void wake();
+    };
+
+    // coroutine type of VTEST_ASYNC bodies, co_await a ut_task to run it
+    // to completion inside another one
+    class ut_task
+    {
+    public:
+        struct promise_type;
+        typedef std::coroutine_handle<promise_type> handle;
+        struct final_awaiter
         {
-            return is_equal(ut_var(v));
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(handle h) noexcept
+            {
+                std::coroutine_handle<> c = h.promise().cont;
+                return c ? c : std::noop_coroutine();
+            }
+            void await_resume() noexcept {}
+        };
+        struct promise_type
+        {
+            std::coroutine_handle<> cont;
+            ut_task get_return_object() { return ut_task(handle::from_promise(*this)); }
+            std::suspend_always initial_suspend() noexcept { return {}; }
+            final_awaiter final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() { std::terminate(); }
+        };
+        explicit ut_task(handle h = handle()) : h_(h) {}
+        ut_task(ut_task&& other) noexcept : h_(other.h_) { other.h_ = handle(); }
+        ut_task& operator=(ut_task&& other) noexcept
+        {
+            if (this != &other) {
+                if (h_) h_.destroy();
+                h_ = other.h_;
+                other.h_ = handle();
+            }
+            return *this;
         }
-        bool operator== (const ut_i8 v) const
+        ~ut_task() { if (h_) h_.destroy(); }
+        bool done() const { return !h_ || h_.done(); }
+        handle get() const { return h_; }
+        bool await_ready() const { return done(); }
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> c)
         {
-            return is_equal(ut_var(v));
+            h_.promise().cont = c;
+            return h_;
         }
-        bool operator== (const ut_i16 v) const
+        void await_resume() {}
+    private:
+        ut_task(const ut_task&);
+        ut_task& operator=(const ut_task&);
+        handle h_;
+    };
+
+    // single threaded event loop driving the VTEST_ASYNC tests, timers and
+    // fd waits use epoll/timerfd on linux, other systems only get timers.
+    // tests spawn from the worker threads, an idle worker drives the loop
+    class ut_loop
+    {
+    public:
+        static ut_loop& instance()
         {
-            return is_equal(ut_var(v));
+            static ut_loop obj_;
+            return obj_;
         }
-        bool operator== (const ut_i32 v) const
+        void spawn(const char* name, ut_task task, ut_u64 timeout_ms,
+            const char* file, int line)
         {
-            return is_equal(ut_var(v));
+            ut_alloc_pause quiet;
+            root r;
+            r.name = name;
+            r.label = name;
+            r.file = file;
+            r.line = line;
+            // the clock starts when the loop takes the root, not while the
+            // test waits behind the others
+            r.start = 0;
+            r.deadline = timeout_ms * 1000000;
+            r.failed = 0;
+            r.node = unit_test::current_test();
+            r.task = std::move(task);
+            if (r.node) ut_test.hold_test(r.node);
+            {
+                std::lock_guard<std::mutex> guard(lock_);
+                spawned_.push_back(std::move(r));
+            }
+            notify();
         }
-        bool operator== (const ut_i64 v) const
+        ut_waker waker(std::coroutine_handle<> h)
         {
-            return is_equal(ut_var(v));
+            ut_waker w = { h, current_ };
+            return w;
         }
-        bool operator== (const ut_u8 v) const
+        void post(const ut_waker& w)
         {
-            return is_equal(ut_var(v));
+            ut_alloc_pause quiet;
+            {
+                std::lock_guard<std::mutex> guard(lock_);
+                posted_.push_back(waiter(w.h, w.root));
+            }
+            notify();
         }
-        bool operator== (const ut_u16 v) const
+        void add_timer(ut_u64 when, std::coroutine_handle<> h)
         {
-            return is_equal(ut_var(v));
+            ut_alloc_pause quiet;
+            timer t = { when, ++timer_seq_, h, current_ };
+            timers_.push(t);
         }
-        bool operator== (const ut_u32 v) const
+#ifdef __linux__
+        void add_fd(int fd, ut_u32 events, std::coroutine_handle<> h)
         {
-            return is_equal(ut_var(v));
+            ut_alloc_pause quiet;
+            fds_[fd] = waiter(h, current_);
+            epoll_event ev;
+            ev.events = events | EPOLLONESHOT;
+            ev.data.fd = fd;
+            if (epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev) != 0) {
+                epoll_ctl(epfd_, EPOLL_CTL_MOD, fd, &ev);
+            }
         }
-        bool operator== (const ut_u64 v) const
+#endif
+        // run until every spawned test has finished or timed out, or with
+        // one until at least one of them has
+        void run(bool one = false)
         {
-            return is_equal(ut_var(v));
+            // the loop's own allocations are not the tests', only the
+            // resumed frames count
+            ut_alloc_pause quiet;
+            int finished = finished_;
+            // the time the loop was stopped for the normal tests does not
+            // count against the roots it holds
+            if (stopped_) {
+                ut_u64 idle = ut_clock::now_ns() - stopped_;
+                std::map<int, root>::iterator it = roots_.begin();
+                for (; it != roots_.end(); it++) {
+                    it->second.start += idle;
+                    it->second.deadline += idle;
+                }
+            }
+            take_posted();
+            while (!roots_.empty()) {
+                take_posted();
+                while (!ready_.empty()) {
+                    waiter w = ready_.front();
+                    ready_.pop_front();
+                    resume(w);
+                }
+                ut_u64 now = ut_clock::now_ns();
+                expire(now);
+                if (roots_.empty() || (one && finished_ != finished)) break;
+                while (!timers_.empty() && timers_.top().when <= now) {
+                    ready_.push_back(waiter(timers_.top().h, timers_.top().root));
+                    timers_.pop();
+                }
+                if (!ready_.empty()) continue;
+                ut_u64 next = next_deadline();
+                if (!timers_.empty() && timers_.top().when < next) {
+                    next = timers_.top().when;
+                }
+                wait(next > now ? next - now : 1);
+            }
+            stopped_ = ut_clock::now_ns();
         }
-        bool operator== (const float v) const
+        static void run_one() { instance().run(true); }
+    private:
+        struct waiter
         {
-            return is_equal(ut_var(v));
+            std::coroutine_handle<> h;
+            int root;
+            waiter() : root(0) {}
+            waiter(std::coroutine_handle<> c, int r) : h(c), root(r) {}
+        };
+        struct timer
+        {
+            ut_u64 when;
+            ut_u64 seq;
+            std::coroutine_handle<> h;
+            int root;
+            bool operator<(const timer& rh) const
+            {
+                return when != rh.when ? when > rh.when : seq > rh.seq;
+            }
+        };
+        struct root
+        {
+            std::string name;
+            const char* label;
+            const char* file;
+            int line;
+            ut_u64 start;
+            ut_u64 deadline;
+            int failed;
+            unit_test::test_node* node;
+            ut_task task;
+        };
+        ut_loop()
+        {
+            last_id_ = 0;
+            current_ = 0;
+            timer_seq_ = 0;
+            finished_ = 0;
+            stopped_ = 0;
+#ifdef __linux__
+            epfd_ = epoll_create1(EPOLL_CLOEXEC);
+            tfd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+            efd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            epoll_event ev;
+            ev.events = EPOLLIN;
+            ev.data.fd = tfd_;
+            epoll_ctl(epfd_, EPOLL_CTL_ADD, tfd_, &ev);
+            ev.data.fd = efd_;
+            epoll_ctl(epfd_, EPOLL_CTL_ADD, efd_, &ev);
+#endif
+            ut_test.set_async_runner(run_one);
         }
-        bool operator== (const double v) const
+        ~ut_loop()
         {
-            return is_equal(ut_var(v));
+#ifdef __linux__
+            close(epfd_);
+            close(tfd_);
+            close(efd_);
+#endif
         }
-        bool operator== (const std::wstring& v) const
+        void resume(const waiter& w)
         {
-            return ws_ == v;
+            std::map<int, root>::iterator it = roots_.find(w.root);
+            if (it == roots_.end()) return;
+            current_ = w.root;
+            // the checks of the body count for its test
+            unit_test::current_test() = it->second.node;
+            int failed = ut_test.test_failures();
+            ut_u64 t0 = ut_tracer.enabled() ? ut_clock::now_ns() : 0;
+            int quiet = ut_alloc_quiet();
+            ut_alloc_quiet() = 0;
+            w.h.resume();
+            ut_alloc_quiet() = quiet;
+            if (t0) {
+                ut_tracer.span(it->second.label, "async", t0, ut_clock::now_ns());
+            }
+            it->second.failed += ut_test.test_failures() - failed;
+            unit_test::current_test() = NULL;
+            current_ = 0;
+            if (it->second.task.done()) {
+                ut_cons.set_color_mode_tip();
+                printf("[async] %s done in %.3f ms%s\n", it->second.name.c_str(),
+                    (ut_clock::now_ns() - it->second.start) / 1e6,
+                    it->second.failed ? ", failed" : "");
+                ut_cons.reset_color_mode();
+                if (t0) {
+                    ut_tracer.async(it->second.label, "async",
+                        it->second.start, ut_clock::now_ns());
+                }
+                finish(w.root);
+            }
         }
-        bool operator== (const std::string& v) const
+        void expire(ut_u64 now)
         {
-            return s_ == v;
+            std::map<int, root>::iterator it = roots_.begin();
+            while (it != roots_.end()) {
+                int id = it->first;
+                root& r = (it++)->second;
+                if (r.deadline > now) continue;
+                ut_cons.set_color_mode_tip();
+                printf("[async] %s timed out after %.3f ms\n", r.name.c_str(),
+                    (now - r.start) / 1e6);
+                ut_cons.reset_color_mode();
+                unit_test::current_test() = r.node;
+                ut_test.check_eq(false, r.name.c_str(), r.line, r.file, 0);
+                unit_test::current_test() = NULL;
+                // destroying the frame destroys the awaited sub tasks too
+                finish(id);
+            }
         }
-        bool operator== (const wchar_t* v) const
+        void finish(int id)
         {
-            return ws_ == v;
+#ifdef __linux__
+            std::map<int, waiter>::iterator it = fds_.begin();
+            while (it != fds_.end()) {
+                if (it->second.root == id) {
+                    epoll_ctl(epfd_, EPOLL_CTL_DEL, it->first, NULL);
+                    fds_.erase(it++);
+                }
+                else {
+                    it++;
+                }
+            }
+#endif
+            std::map<int, root>::iterator r = roots_.find(id);
+            unit_test::test_node* node = r->second.node;
+            double ms = (ut_clock::now_ns() - r->second.start) / 1e6;
+            // the frame goes before the test ends, its memory is not kept
+            roots_.erase(r);
+            finished_++;
+            if (node) ut_test.async_done(node, ms);
         }
-        bool operator== (const char* v) const
+        ut_u64 next_deadline() const
         {
-            return s_ == v;
+            ut_u64 next = (ut_u64)-1;
+            std::map<int, root>::const_iterator it = roots_.begin();
+            for (; it != roots_.end(); it++) {
+                if (it->second.deadline < next) next = it->second.deadline;
+            }
+            return next;
         }
-        bool operator!= (const ut_var& rh) const
+        void take_posted()
         {
-            return !is_equal(rh);
+            std::lock_guard<std::mutex> guard(lock_);
+            ready_.insert(ready_.end(), posted_.begin(), posted_.end());
+            posted_.clear();
+            ut_u64 now = ut_clock::now_ns();
+            for (size_t i = 0; i < spawned_.size(); i++) {
+                std::coroutine_handle<> h = spawned_[i].task.get();
+                spawned_[i].start = now;
+                spawned_[i].deadline += now;
+                int id = ++last_id_;
+                roots_[id] = std::move(spawned_[i]);
+                ready_.push_back(waiter(h, id));
+            }
+            spawned_.clear();
         }
-        bool operator!= (const bool v) const
+        void notify()
         {
-            return !is_equal(ut_var(v));
+#ifdef __linux__
+            ut_u64 one = 1;
+            if (write(efd_, &one, 8) < 0) {}
+#else
+            cond_.notify_one();
+#endif
         }
-        bool operator!= (const ut_i8 v) const
+        void wait(ut_u64 ns)
         {
-            return !is_equal(ut_var(v));
+#ifdef __linux__
+            itimerspec its;
+            memset(&its, 0, sizeof(its));
+            its.it_value.tv_sec = ns / 1000000000;
+            its.it_value.tv_nsec = ns % 1000000000;
+            timerfd_settime(tfd_, 0, &its, NULL);
+            epoll_event evs[64];
+            int n = epoll_wait(epfd_, evs, 64, -1);
+            ut_u64 v;
+            for (int i = 0; i < n; i++) {
+                int fd = evs[i].data.fd;
+                if (fd == tfd_ || fd == efd_) {
+                    if (read(fd, &v, 8) < 0) {}
+                    continue;
+                }
+                std::map<int, waiter>::iterator it = fds_.find(fd);
+                if (it == fds_.end()) continue;
+                epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, NULL);
+                ready_.push_back(it->second);
+                fds_.erase(it);
+            }
+#else
+            std::unique_lock<std::mutex> guard(lock_);
+            if (posted_.empty() && spawned_.empty()) {
+                cond_.wait_for(guard, std::chrono::nanoseconds(ns));
+            }
+#endif
         }
-        bool operator!= (const ut_i16 v) const
+    private:
+        int last_id_;
+        int current_;
+        ut_u64 timer_seq_;
+        int finished_;
+        ut_u64 stopped_;
+        std::map<int, root> roots_;
+        std::vector<root> spawned_;
+        std::deque<waiter> ready_;
+        std::vector<waiter> posted_;
+        std::priority_queue<timer> timers_;
+        std::mutex lock_;
+#ifdef __linux__
+        int epfd_;
+        int tfd_;
+        int efd_;
+        std::map<int, waiter> fds_;
+#else
+        std::condition_variable cond_;
+#endif
+    };
+
+    inline void ut_waker::wake()
+    {
+        ut_loop::instance().post(*this);
+    }
+
+    // co_await ut_sleep(ms) suspends the test without blocking the loop
+    struct ut_sleep
+    {
+        ut_u64 ms;
+        explicit ut_sleep(ut_u64 v) : ms(v) {}
+        bool await_ready() const { return false; }
+        void await_suspend(std::coroutine_handle<> h)
         {
-            return !is_equal(ut_var(v));
+            ut_loop::instance().add_timer(ut_clock::now_ns() + ms * 1000000, h);
         }
-        bool operator!= (const ut_i32 v) const
+        void await_resume() {}
+    };
+
+    // co_await ut_yield() lets the other tests run
+    struct ut_yield
+    {
+        bool await_ready() const { return false; }
+        void await_suspend(std::coroutine_handle<> h)
         {
-            return !is_equal(ut_var(v));
+            ut_loop::instance().waker(h).wake();
         }
-        bool operator!= (const ut_i64 v) const
+        void await_resume() {}
+    };
+
+#ifdef __linux__
+    // co_await ut_readable(fd) / ut_writable(fd), one waiter per fd
+    struct ut_fd_wait
+    {
+        int fd;
+        ut_u32 events;
+        bool await_ready() const { return false; }
+        void await_suspend(std::coroutine_handle<> h)
         {
-            return !is_equal(ut_var(v));
+            ut_loop::instance().add_fd(fd, events, h);
         }
-        bool operator!= (const ut_u8 v) const
+        void await_resume() {}
+    };
+    inline ut_fd_wait ut_readable(int fd)
+    {
+        ut_fd_wait w = { fd, EPOLLIN };
+        return w;
+    }
+    inline ut_fd_wait ut_writable(int fd)
+    {
+        ut_fd_wait w = { fd, EPOLLOUT };
+        return w;
+    }
+#endif
+
+    // one shot value, set_value() may be called from any thread and
+    // resumes every coroutine waiting in co_await future
+    template <typename T>
+    class ut_future
+    {
+    public:
+        ut_future() : s_(new state()) { s_->ready = false; }
+        void set_value(const T& v)
         {
-            return !is_equal(ut_var(v));
+            std::vector<ut_waker> waiters;
+            {
+                std::lock_guard<std::mutex> guard(s_->lock);
+                s_->value = v;
+                s_->ready = true;
+                waiters.swap(s_->waiters);
+            }
+            for (size_t i = 0; i < waiters.size(); i++) {
+                waiters[i].wake();
+            }
         }
-        bool operator!= (const ut_u16 v) const
+        bool ready() const
         {
-            return !is_equal(ut_var(v));
+            std::lock_guard<std::mutex> guard(s_->lock);
+            return s_->ready;
         }
-        bool operator!= (const ut_u32 v) const
+        bool await_ready() const { return ready(); }
+        bool await_suspend(std::coroutine_handle<> h)
         {
-            return !is_equal(ut_var(v));
+            std::lock_guard<std::mutex> guard(s_->lock);
+            if (s_->ready) return false;
+            s_->waiters.push_back(ut_loop::instance().waker(h));
+            return true;
         }
-        bool operator!= (const ut_u64 v) const
+        T await_resume() const
         {
-            return !is_equal(ut_var(v));
+            std::lock_guard<std::mutex> guard(s_->lock);
+            return s_->value;
         }
-        bool operator!= (const float v) const
+    private:
+        struct state
         {
-            return !is_equal(ut_var(v));
+            std::mutex lock;
+            bool ready;
+            T value;
+            std::vector<ut_waker> waiters;
+        };
+        std::shared_ptr<state> s_;
+    };
+#endif
+
+#ifdef VTEST_HAS_PROFILER
+    // SIGPROF sampling profiler of --profile=<pattern>, the stacks go to a
+    // preallocated buffer and are written as folded stacks (root first,
+    // the test name as the root frame) ready for flamegraph.pl. symbols
+    // come from dladdr, link with -rdynamic to name non exported functions.
+    // the timer is process wide, one test is profiled at a time and with
+    // --jobs the tests running beside it land in its samples
+    class ut_profiler
+    {
+    public:
+        static ut_profiler& instance()
+        {
+            static ut_profiler obj_;
+            return obj_;
         }
-        bool operator!= (const double v) const
+        static void hook(unit_test::test_node& t, bool begin)
         {
-            return !is_equal(ut_var(v));
+            instance().on_test(t, begin);
         }
-        bool operator!= (const std::wstring& v) const
+    private:
+        enum { DEPTH = 64, SKIP = 2 };
+        ut_profiler()
         {
-            return ws_ != v;
+            owner_ = NULL;
+            frames_ = NULL;
+            depths_ = NULL;
+            max_ = 0;
+            opened_ = false;
+            ut_test.add_hook(hook);
         }
-        bool operator!= (const std::string& v) const
+        void on_test(unit_test::test_node& t, bool begin)
         {
-            return s_ != v;
+            std::string pattern;
+            if (!ut_test.get_option("--profile=", pattern)) return;
+            // the hooks run on the workers, one test at a time owns the timer
+            std::lock_guard<std::mutex> guard(lock_);
+            if (begin) {
+                if (owner_ == NULL && ut_glob_match(pattern.c_str(), t.fi.func.c_str())
+                    && start(t.fi.func)) {
+                    owner_ = &t;
+                }
+            }
+            else if (owner_ == &t) {
+                stop();
+                write(t.fi.func);
+                owner_ = NULL;
+            }
         }
-        bool operator!= (const wchar_t* v) const
+        bool start(const std::string& name)
         {
-            return ws_ != v;
+            std::string v;
+            int hz = ut_test.get_option("--profile-hz=", v) ? atoi(v.c_str()) : 199;
+            int max = ut_test.get_option("--profile-max=", v) ? atoi(v.c_str()) : 20000;
+            if (hz <= 0) hz = 199;
+            if (hz > 10000) hz = 10000;
+            if (max <= 0) max = 20000;
+            if (max != max_) {
+                delete[] frames_;
+                delete[] depths_;
+                frames_ = new void*[(size_t)max * DEPTH];
+                depths_ = new int[max];
+                max_ = max;
+            }
+            // the first backtrace() loads the unwinder, not signal safe
+            void* warm[4];
+            backtrace(warm, 4);
+            count_.store(0);
+            struct sigaction sa;
+            memset(&sa, 0, sizeof(sa));
+            sa.sa_handler = on_signal;
+            sa.sa_flags = SA_RESTART;
+            sigemptyset(&sa.sa_mask);
+            sigaction(SIGPROF, &sa, &old_);
+            itimerval it;
+            it.it_interval.tv_sec = 1 / hz;
+            it.it_interval.tv_usec = hz > 1 ? 1000000 / hz : 0;
+            it.it_value = it.it_interval;
+            ut_cons.set_color_mode_tip();
+            if (setitimer(ITIMER_PROF, &it, NULL) != 0) {
+                printf("[profile] %s: setitimer failed, %s\n", name.c_str(),
+                    strerror(errno));
+                ut_cons.reset_color_mode();
+                sigaction(SIGPROF, &old_, NULL);
+                return false;
+            }
+            // SIGPROF is process wide, the tests running beside it are sampled too
+            if (ut_test.jobs() > 1) {
+                printf("[profile] warning: %s runs with --jobs=%d, the samples of "
+                    "the other running tests are mixed in\n", name.c_str(), ut_test.jobs());
+            }
+            ut_cons.reset_color_mode();
+            return true;
         }
-        bool operator!= (const char* v) const
+        void stop()
         {
-            return s_ != v;
+            itimerval it;
+            memset(&it, 0, sizeof(it));
+            setitimer(ITIMER_PROF, &it, NULL);
+            sigaction(SIGPROF, &old_, NULL);
         }
-        std::string to_str()
+        static void on_signal(int)
+        {
+            ut_profiler& p = instance();
+            int i = p.count_.fetch_add(1);
+            if (i < p.max_) {
+                p.depths_[i] = backtrace(p.frames_ + (size_t)i * DEPTH, DEPTH);
+            }
+        }
+        void write(const std::string& name)
+        {
+            int total = count_.load();
+            int n = total < max_ ? total : max_;
+            std::map<std::string, int> stacks;
+            for (int i = 0; i < n; i++) {
+                std::string s = name;
+                void** f = frames_ + (size_t)i * DEPTH;
+                for (int k = depths_[i] - 1; k >= SKIP; k--) {
+                    s += ";";
+                    // return addresses point after the call
+                    s += symbol((char*)f[k] - (k > SKIP ? 1 : 0));
+                }
+                stacks[s]++;
+            }
+            std::string path = "vtest_profile.folded";
+            ut_test.get_option("--profile-out=", path);
+            FILE* fp = fopen(path.c_str(), opened_ ? "a" : "w");
+            if (fp) {
+                std::map<std::string, int>::iterator it;
+                for (it = stacks.begin(); it != stacks.end(); it++) {
+                    fprintf(fp, "%s %d\n", it->first.c_str(), it->second);
+                }
+                fclose(fp);
+                opened_ = true;
+            }
+            ut_cons.set_color_mode_tip();
+            printf("[profile] %s: %d samples, %d dropped -> %s\n", name.c_str(),
+                n, total - n, path.c_str());
+            ut_cons.reset_color_mode();
+        }
+        const std::string& symbol(void* addr)
         {
+            std::map<void*, std::string>::iterator it = syms_.find(addr);
+            if (it != syms_.end()) return it->second;
+            std::string& s = syms_[addr];
             char buf[64];
-            buf[0] = 0;
-            switch (t_)
-            {
-            case UTD_BOOL: snprintf(buf, 64, v_.b ? "true" : "false"); break;
-            case UTD_UCHAR: snprintf(buf, 64, "%u", v_.c); break;
-            case UTD_CHAR: snprintf(buf, 64, "%c", v_.c); break;
-            case UTD_USHORT: snprintf(buf, 64, "%u", v_.s); break;
-            case UTD_SHORT: snprintf(buf, 64, "%d", v_.s); break;
-            case UTD_UINT: snprintf(buf, 64, "%u", v_.i); break;
-            case UTD_INT: snprintf(buf, 64, "%d", v_.i); break;
-#ifdef _MSC_VER
-            case UTD_UINT64: snprintf(buf, 64, "%llu", v_.l); break;
-            case UTD_INT64: snprintf(buf, 64, "%lld", v_.l); break;
+            Dl_info info;
+            if (dladdr(addr, &info) && info.dli_sname) {
+                int st = 0;
+                char* dm = abi::__cxa_demangle(info.dli_sname, NULL, NULL, &st);
+                s = (st == 0 && dm) ? dm : info.dli_sname;
+                free(dm);
+            }
+            else if (dladdr(addr, &info) && info.dli_fname) {
+                snprintf(buf, 64, "+0x%llx", (unsigned long long)
+                    ((char*)addr - (char*)info.dli_fbase));
+                s = std::string(ut_test.get_file_name(info.dli_fname)) + buf;
+            }
+            else {
+                snprintf(buf, 64, "0x%llx", (unsigned long long)(size_t)addr);
+                s = buf;
+            }
+            return s;
+        }
+    private:
+        unit_test::test_node* owner_;
+        void** frames_;
+        int* depths_;
+        int max_;
+        bool opened_;
+        std::atomic<int> count_;
+        struct sigaction old_;
+        std::map<void*, std::string> syms_;
+        std::mutex lock_;
+    };
+    static ut_profiler& ut_prof = ut_profiler::instance();
+#endif
+
+#ifdef VTEST_HAS_MEMSTAT
+    // peak RSS growth and page faults of the tests marked with VTEST_MEMORY,
+    // or of every test with --memory. linux resets the high water mark
+    // through /proc/self/clear_refs so the peak belongs to the test,
+    // elsewhere only a new process peak is seen. RSS and faults are process
+    // wide, they include the stress threads of the test, with --jobs the
+    // concurrent tests overlap
+    class ut_memstat
+    {
+    public:
+        struct record
+        {
+            long long base;
+            long long hwm;
+            long long peak;
+            long minflt;
+            long majflt;
+        };
+        static ut_memstat& instance()
+        {
+            static ut_memstat obj_;
+            return obj_;
+        }
+        static void hook(unit_test::test_node& t, bool begin)
+        {
+            instance().on_test(t, begin);
+        }
+        static void report()
+        {
+            instance().show();
+        }
+        static long long rss() { return read_rss(); }
+        void track(const char* name)
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            tracked_.insert(name);
+        }
+        // peak RSS growth of the running test so far, -1 outside a tracked
+        // test
+        long long peak()
+        {
+            unit_test::test_node* t = unit_test::current_test();
+            std::lock_guard<std::mutex> guard(lock_);
+            std::map<unit_test::test_node*, record>::iterator it = live_.find(t);
+            if (t == NULL || it == live_.end()) return -1;
+            long long hwm = read_hwm();
+            return hwm > it->second.hwm ? hwm - it->second.hwm : 0;
+        }
+    private:
+        ut_memstat()
+        {
+            ut_test.add_hook(hook);
+            ut_test.add_report(report);
+        }
+        void on_test(unit_test::test_node& t, bool begin)
+        {
+            std::string v;
+            if (!ut_test.get_flag("--memory", v)) {
+                std::lock_guard<std::mutex> guard(lock_);
+                if (tracked_.count(t.fi.func) == 0) return;
+            }
+            struct rusage ru;
+            getrusage(RUSAGE_SELF, &ru);
+            std::lock_guard<std::mutex> guard(lock_);
+            if (begin) {
+                reset_hwm();
+                record& r = live_[&t];
+                read_mem(r.base, r.hwm);
+                r.peak = 0;
+                r.minflt = ru.ru_minflt;
+                r.majflt = ru.ru_majflt;
+                return;
+            }
+            std::map<unit_test::test_node*, record>::iterator it = live_.find(&t);
+            if (it == live_.end()) return;
+            record r = it->second;
+            live_.erase(it);
+            long long hwm = read_hwm();
+            r.peak = hwm > r.hwm ? hwm - r.hwm : 0;
+            r.minflt = ru.ru_minflt - r.minflt;
+            r.majflt = ru.ru_majflt - r.majflt;
+            done_.push_back(std::make_pair(t.fi.func, r));
+        }
+        static bool by_peak(const std::pair<std::string, record>& a,
+            const std::pair<std::string, record>& b)
+        {
+            return a.second.peak > b.second.peak;
+        }
+        // --memory prints the 20 largest tests, --memory=N the N largest.
+        // a --client request prints the table of its served child, the
+        // server only measures its fixtures
+        void show()
+        {
+            std::string v;
+            if (!ut_test.get_flag("--memory", v)) return;
+            size_t n = v.empty() ? 20 : (size_t)atoi(v.c_str());
+            std::sort(done_.begin(), done_.end(), by_peak);
+            if (n > done_.size()) n = done_.size();
+            printf("%-32s %12s %12s %10s %8s\n", "test", "base KB", "peak +KB",
+                "minflt", "majflt");
+            for (size_t i = 0; i < n; i++) {
+                const record& r = done_[i].second;
+                printf("%-32s %12lld %12lld %10ld %8ld\n", done_[i].first.c_str(),
+                    r.base / 1024, r.peak / 1024, r.minflt, r.majflt);
+            }
+        }
+#ifdef __linux__
+        static void reset_hwm()
+        {
+            FILE* fp = fopen("/proc/self/clear_refs", "w");
+            if (fp) {
+                fputs("5", fp);
+                fclose(fp);
+            }
+        }
+        // VmHWM comes before VmRSS in /proc/self/status
+        static void read_mem(long long& rss, long long& hwm)
+        {
+            rss = hwm = 0;
+            FILE* fp = fopen("/proc/self/status", "r");
+            if (fp == NULL) return;
+            char line[256];
+            while (fgets(line, sizeof(line), fp)) {
+                if (strncmp(line, "VmHWM:", 6) == 0) {
+                    hwm = atoll(line + 6) * 1024;
+                }
+                else if (strncmp(line, "VmRSS:", 6) == 0) {
+                    rss = atoll(line + 6) * 1024;
+                    break;
+                }
+            }
+            fclose(fp);
+        }
+        static long long read_rss()
+        {
+            long long rss, hwm;
+            read_mem(rss, hwm);
+            return rss;
+        }
+        static long long read_hwm()
+        {
+            long long rss, hwm;
+            read_mem(rss, hwm);
+            return hwm;
+        }
 #else
-            case UTD_UINT64: snprintf(buf, 64, "%lu", v_.l); break;
-            case UTD_INT64: snprintf(buf, 64, "%li", v_.l); break;
+        static void reset_hwm() {}
+        static void read_mem(long long& rss, long long& hwm)
+        {
+            rss = hwm = read_hwm();
+        }
+        static long long read_rss() { return read_hwm(); }
+        static long long read_hwm()
+        {
+            struct rusage ru;
+            getrusage(RUSAGE_SELF, &ru);
+            return (long long)ru.ru_maxrss;
+        }
+#endif
+    private:
+        std::mutex lock_;
+        std::map<unit_test::test_node*, record> live_;
+        std::vector<std::pair<std::string, record> > done_;
+        std::set<std::string> tracked_;
+    };
+    static ut_memstat& ut_mem = ut_memstat::instance();
+
+    class ut_memory_holder
+    {
+    public:
+        ut_memory_holder(const char* name)
+        {
+            ut_mem.track(name);
+        }
+    };
 #endif
-            case UTD_FLOAT: snprintf(buf, 64, "%f", v_.f); break;
-            case UTD_DOUBLE: snprintf(buf, 64, "%f", v_.r); break;
-            case UTD_STR: return s_.c_str();
-                //case UTD_WSTR: return ws_.c_str();
-            default:
-                break;
+
+    // the tests of a --repeat / --duration run, sampled at the end of every
+    // round. a test fails when it fails in some rounds only (flaky) or when
+    // its time, RSS or live allocations grow steadily over the rounds
+    //   --drift=20  growth in percent of the mean over the run that counts
+    class ut_soak
+    {
+    public:
+        static ut_soak& instance()
+        {
+            static ut_soak obj_;
+            return obj_;
+        }
+        // RSS and allocations are what the test kept, summed over the
+        // rounds, a leak grows them by the same amount every round. RSS is
+        // process wide, with --jobs the tests running together mix, the
+        // allocations are the test's own. the samples of the begin are
+        // kept by test, an async test ends on the loop thread
+        static void hook(unit_test::test_node& t, bool begin)
+        {
+            if (!ut_test.soak() || t.fi.first) return;
+            double rss = 0;
+#ifdef VTEST_HAS_MEMSTAT
+            rss = (double)ut_memstat::rss();
+#endif
+            double allocs = t.allocs ? (double)t.allocs->load() : 0;
+            ut_soak& s = instance();
+            std::lock_guard<std::mutex> guard(s.lock_);
+            if (begin) {
+                s.start_[&t] = std::make_pair(rss, allocs);
+                return;
             }
-            return std::string(buf);
+            std::map<unit_test::test_node*, std::pair<double, double> >::iterator it
+                = s.start_.find(&t);
+            if (it == s.start_.end()) return;
+            double rss0 = it->second.first, allocs0 = it->second.second;
+            s.start_.erase(it);
+            series& x = s.tests_[t.fi.func];
+            x.file = t.fi.file;
+            x.line = t.fi.line;
+            x.ms.push_back(t.ms);
+            // the first round pays for lazy setup, the sums start after it
+            if (x.ms.size() > 1) {
+                x.rss.push_back((x.rss.empty() ? 0 : x.rss.back()) + rss - rss0);
+                x.allocs.push_back((x.allocs.empty() ? 0 : x.allocs.back())
+                    + allocs - allocs0);
+            }
+            if (t.failed) x.failed++;
+        }
+        static void report()
+        {
+            if (ut_test.soak()) instance().show();
         }
     private:
-        inline void init()
+        struct series
         {
-            t_ = UTD_BOOL;
-            memset(&v_, 0, sizeof(number));
+            series() : failed(0), file(""), line(0) {}
+            std::vector<double> ms;
+            std::vector<double> rss;
+            std::vector<double> allocs;
+            int failed;
+            const char* file;
+            int line;
+        };
+        ut_soak()
+        {
+            ut_test.add_hook(hook);
+            ut_test.add_report(report);
         }
-        bool is_equal(const ut_var& rh) const
+        // least squares slope per round and correlation of the samples
+        static void trend(const std::vector<double>& y, double& slope,
+            double& r, double& mean)
         {
-            if (t_ == UTD_BOOL)
-            {
-                if (rh.t_ == UTD_BOOL) {
-                    return v_.b == rh.v_.b;
-                }
-                else if (rh.t_ == UTD_FLOAT || rh.t_ == UTD_DOUBLE) {
-                    return v_.b == (abs(rh.to_double()) > 0.00000000001);
-                }
-                else if (rh.t_ >= UTD_NUM_START && rh.t_ <= UTD_NUM_END) {
-                    return v_.b == (rh.to_u64() > 0);
-                }
-                return false;
+            size_t n = y.size();
+            double sx = 0, sy = 0, sxx = 0, syy = 0, sxy = 0;
+            for (size_t i = 0; i < n; i++) {
+                sx += i;
+                sy += y[i];
+                sxx += (double)i * i;
+                syy += y[i] * y[i];
+                sxy += i * y[i];
             }
-            else if (t_ == UTD_FLOAT || t_ == UTD_DOUBLE)
-            {
-                if (rh.t_ == UTD_BOOL) {
-                    return rh.v_.b == (abs(to_double()) > 0.00000000001);
-                }
-                else if (rh.t_ == UTD_FLOAT || rh.t_ == UTD_DOUBLE) {
-                    return abs(to_double() - rh.to_double()) < 0.00000000001;
+            mean = n ? sy / n : 0;
+            double vx = n * sxx - sx * sx, vy = n * syy - sy * sy;
+            slope = vx > 0 ? (n * sxy - sx * sy) / vx : 0;
+            r = vx > 0 && vy > 0 ? (n * sxy - sx * sy) / sqrt(vx * vy) : 0;
+        }
+        // growing over the run by more than min, steadily (r > 0.8)
+        static bool drifts(const std::vector<double>& y, double drift,
+            double floor, double& growth)
+        {
+            double slope, r, mean;
+            trend(y, slope, r, mean);
+            growth = slope * (y.size() - 1);
+            double min = mean * drift > floor ? mean * drift : floor;
+            return y.size() >= 5 && r > 0.8 && growth > min;
+        }
+        void show()
+        {
+            std::string v;
+            double drift = (ut_test.get_option("--drift=", v) ? atof(v.c_str()) : 20) / 100;
+            printf("Soak of %d rounds\n", ut_test.rounds());
+            printf("%-32s %7s %10s %10s %12s %10s\n", "test", "failed", "ms first",
+                "ms last", "rss +KB", "allocs +");
+            std::map<std::string, series>::iterator it;
+            for (it = tests_.begin(); it != tests_.end(); it++) {
+                series& x = it->second;
+                int n = (int)x.ms.size();
+                double gt = 0, gr = 0, ga = 0;
+                std::vector<std::string> why;
+                char buf[96];
+                if (x.failed > 0 && x.failed < n) {
+                    snprintf(buf, sizeof(buf), "flaky, failed %d of %d rounds (%.1f%%)",
+                        x.failed, n, 100.0 * x.failed / n);
+                    why.push_back(buf);
                 }
-                else if (rh.t_ >= UTD_NUM_START && rh.t_ <= UTD_NUM_END) {
-                    return abs(to_double() - rh.to_u64()) < 0.00000000001;
+                if (drifts(x.ms, drift, 1, gt)) {
+                    snprintf(buf, sizeof(buf), "time grows %.3f ms", gt);
+                    why.push_back(buf);
                 }
-                return false;
-            }
-            else if (t_ >= UTD_NUM_START && t_ <= UTD_NUM_END)
-            {
-                if (rh.t_ == UTD_BOOL) {
-                    return rh.v_.b == (to_u64() > 0);
+#ifdef VTEST_HAS_MEMSTAT
+                if (drifts(x.rss, 0, 1 << 20, gr)) {
+                    snprintf(buf, sizeof(buf), "RSS grows %.0f KB", gr / 1024);
+                    why.push_back(buf);
                 }
-                else if (rh.t_ == UTD_FLOAT || rh.t_ == UTD_DOUBLE) {
-                    return abs(to_u64() - rh.to_double()) < 0.00000000001;
+#endif
+                if (drifts(x.allocs, 0, n / 2.0, ga)) {
+                    snprintf(buf, sizeof(buf), "live allocations grow by %.0f", ga);
+                    why.push_back(buf);
                 }
-                else if (rh.t_ >= UTD_NUM_START && rh.t_ <= UTD_NUM_END) {
-                    return to_u64() == rh.to_u64();
+                printf("%-32s %7d %10.3f %10.3f %12.0f %10.0f\n", it->first.c_str(),
+                    x.failed, x.ms.front(), x.ms.back(),
+                    x.rss.empty() ? 0 : x.rss.back() / 1024,
+                    x.allocs.empty() ? 0 : x.allocs.back());
+                for (size_t i = 0; i < why.size(); i++) {
+                    ut_cons.set_color_mode_tip();
+                    printf("Expect: %s stable, Return Value: %s\n", it->first.c_str(),
+                        why[i].c_str());
+                    ut_cons.reset_color_mode();
+                    ut_test.check_eq(false, it->first.c_str(), x.line, x.file, (int)i);
                 }
-                return false;
             }
-            else if (t_ == UTD_STR)
-            {
-                if (rh.t_ == UTD_STR) return s_ == rh.s_;
-                return false;
+            printf("--------------------------------------------------\n");
+        }
+        std::mutex lock_;
+        std::map<std::string, series> tests_;
+        std::map<unit_test::test_node*, std::pair<double, double> > start_;
+    };
+    static ut_soak& ut_soaker = ut_soak::instance();
+
+    // log bucketed latency histogram in ns, values below 256 are exact and
+    // every power of two above is split in 128 buckets (error < 1%), the
+    // counters are atomic so recorders on many threads can merge lock-free
+    class ut_histogram
+    {
+    public:
+        enum { SUB_BITS = 7, SUB = 1 << SUB_BITS,
+            BUCKETS = (65 - SUB_BITS) << SUB_BITS };
+        ut_histogram()
+        {
+            counts_ = new std::atomic<ut_u64>[BUCKETS];
+            reset();
+        }
+        ~ut_histogram() { delete[] counts_; }
+        void reset()
+        {
+            for (int i = 0; i < BUCKETS; i++) {
+                counts_[i].store(0, std::memory_order_relaxed);
             }
-            else if (t_ == UTD_WSTR)
-            {
-                if (rh.t_ == UTD_WSTR) return ws_ == rh.ws_;
-                return false;
+            count_.store(0);
+            sum_.store(0);
+            min_.store((ut_u64)-1);
+            max_.store(0);
+        }
+        void record(ut_u64 v)
+        {
+            counts_[bucket(v)].fetch_add(1, std::memory_order_relaxed);
+            count_.fetch_add(1, std::memory_order_relaxed);
+            sum_.fetch_add(v, std::memory_order_relaxed);
+            update_min(v);
+            update_max(v);
+        }
+        // add the counts of a thread local recorder
+        void merge(const ut_u64* counts, ut_u64 count, ut_u64 sum,
+            ut_u64 min, ut_u64 max)
+        {
+            if (count == 0) return;
+            for (int i = 0; i < BUCKETS; i++) {
+                if (counts[i]) {
+                    counts_[i].fetch_add(counts[i], std::memory_order_relaxed);
+                }
             }
-            return false;
+            count_.fetch_add(count, std::memory_order_relaxed);
+            sum_.fetch_add(sum, std::memory_order_relaxed);
+            update_min(min);
+            update_max(max);
         }
-        double to_double() const
+        ut_u64 count() const { return count_.load(); }
+        ut_u64 min_value() const { return count() ? min_.load() : 0; }
+        ut_u64 max_value() const { return max_.load(); }
+        double mean() const
         {
-            switch (t_)
-            {
-            case UTD_FLOAT: return v_.f;
-            case UTD_DOUBLE: return v_.r;
-            default:
-                break;
+            ut_u64 n = count();
+            return n ? (double)sum_.load() / n : 0;
+        }
+        // highest value of the bucket holding the p-th percentile
+        ut_u64 percentile(double p) const
+        {
+            ut_u64 n = count();
+            if (n == 0) return 0;
+            ut_u64 rank = (ut_u64)ceil(p / 100.0 * n);
+            if (rank == 0) rank = 1;
+            ut_u64 seen = 0;
+            for (int i = 0; i < BUCKETS; i++) {
+                seen += counts_[i].load(std::memory_order_relaxed);
+                if (seen >= rank) {
+                    ut_u64 v = highest(i);
+                    return v < max_value() ? v : max_value();
+                }
             }
-            return 0.F;
+            return max_value();
         }
-        ut_u64 to_u64() const
+        void show(const char* name) const
         {
-            switch (t_)
-            {
-            case UTD_CHAR:
-            case UTD_UCHAR: return v_.c;
-            case UTD_SHORT:
-            case UTD_USHORT: return v_.s;
-            case UTD_INT:
-            case UTD_UINT: return v_.i;
-            case UTD_INT64:
-            case UTD_UINT64: return v_.l;
-            default:
-                break;
+            static const double ps[] = { 50, 90, 99, 99.9, 99.99 };
+            ut_cons.set_color_mode_tip();
+            printf("[latency] %s: count %llu, min %llu ns, mean %.0f ns\n",
+                name, (unsigned long long)count(), (unsigned long long)min_value(),
+                mean());
+            for (size_t i = 0; i < sizeof(ps) / sizeof(ps[0]); i++) {
+                printf("  p%-6g %12llu ns\n", ps[i],
+                    (unsigned long long)percentile(ps[i]));
             }
-            return 0;
+            printf("  max     %12llu ns\n", (unsigned long long)max_value());
+            ut_cons.reset_color_mode();
+        }
+        static int bucket(ut_u64 v)
+        {
+            if (v < 2 * SUB) return (int)v;
+            int shift = ut_msb64(v) - SUB_BITS;
+            return (int)((shift << SUB_BITS) + (v >> shift));
+        }
+        static ut_u64 highest(int i)
+        {
+            if (i < 2 * SUB) return i;
+            int shift = (i >> SUB_BITS) - 1;
+            ut_u64 sub = i - ((ut_u64)shift << SUB_BITS);
+            return ((sub + 1) << shift) - 1;
         }
     private:
-        enum UT_DATA_TYPE
+        ut_histogram(const ut_histogram&);
+        ut_histogram& operator=(const ut_histogram&);
+        void update_min(ut_u64 v)
         {
-            UTD_BOOL = 1,
-            UTD_CHAR, UTD_SHORT, UTD_INT, UTD_INT64,
-            UTD_UCHAR, UTD_USHORT, UTD_UINT, UTD_UINT64,
-            UTD_FLOAT, UTD_DOUBLE, UTD_STR, UTD_WSTR,
-            UTD_NUM_START = UTD_CHAR,
-            UTD_NUM_END = UTD_UINT64
-        };
-        union number
+            ut_u64 cur = min_.load(std::memory_order_relaxed);
+            while (v < cur && !min_.compare_exchange_weak(cur, v)) {}
+        }
+        void update_max(ut_u64 v)
         {
-            bool b;
-            ut_i8 c;
-            ut_i16 s;
-            ut_i32 i;
-            ut_i64 l;
-            float f;
-            double r;
-        } v_;
-        UT_DATA_TYPE t_;
-        std::string s_;
-        std::wstring ws_;
+            ut_u64 cur = max_.load(std::memory_order_relaxed);
+            while (v > cur && !max_.compare_exchange_weak(cur, v)) {}
+        }
+    private:
+        std::atomic<ut_u64>* counts_;
+        std::atomic<ut_u64> count_;
+        std::atomic<ut_u64> sum_;
+        std::atomic<ut_u64> min_;
+        std::atomic<ut_u64> max_;
     };
-    typedef std::vector<std::vector<ut_var> > ut_vars;
 
-    class kv_cache
+    // plain counters owned by one thread, merged into the histogram by
+    // flush() or when the recorder goes out of scope
+    class ut_latency_recorder
     {
     public:
-        void set(const std::string& key, ut_var v)
+        ut_latency_recorder(ut_histogram& h) : h_(h)
         {
-            kv_[key] = v;
+            counts_ = new ut_u64[ut_histogram::BUCKETS];
+            clear();
         }
-        ut_var get(const std::string& key)
+        ~ut_latency_recorder()
         {
-            if (kv_.find(key) != kv_.end()) {
-                return kv_[key];
-            }
-            else {
-                return ut_var();
-            }
+            flush();
+            delete[] counts_;
         }
-        static kv_cache& instance()
+        void record(ut_u64 v)
         {
-            static kv_cache obj_;
-            return obj_;
+            counts_[ut_histogram::bucket(v)]++;
+            count_++;
+            sum_ += v;
+            if (v < min_) min_ = v;
+            if (v > max_) max_ = v;
+        }
+        // record the time passed since t0 = ut_clock::now_ns()
+        void record_since(ut_u64 t0) { record(ut_clock::now_ns() - t0); }
+        void flush()
+        {
+            h_.merge(counts_, count_, sum_, min_, max_);
+            clear();
         }
     private:
-        UT_HASH_MAP<std::string, ut_var> kv_;
+        ut_latency_recorder(const ut_latency_recorder&);
+        ut_latency_recorder& operator=(const ut_latency_recorder&);
+        void clear()
+        {
+            memset(counts_, 0, sizeof(ut_u64) * ut_histogram::BUCKETS);
+            count_ = 0;
+            sum_ = 0;
+            min_ = (ut_u64)-1;
+            max_ = 0;
+        }
+    private:
+        ut_histogram& h_;
+        ut_u64* counts_;
+        ut_u64 count_;
+        ut_u64 sum_;
+        ut_u64 min_;
+        ut_u64 max_;
     };
-    static kv_cache& ut_kv = kv_cache::instance();
 
 #define TIPC(x,...)\
 {\
@@ -740,7 +5313,7 @@ namespace vtest
 {\
     ut_var v1 = (a), v2 = (b);\
     bool eq = (v1 == v2);\
-    if (eq == false) {\
+    if (eq == false && ut_test.will_report()) {\
         TIP("Expect: %s, Return Value: %s",\
         v1.to_str().c_str(), v2.to_str().c_str());\
     }\
@@ -751,12 +5324,78 @@ namespace vtest
     TIP(t);\
     EXPECT_EQ(a,b);\
 }
+#define EXPECT_ARRAY_NEAR(a,b,n,tol)\
+{\
+    ut_array_result ar = ut_array_cmp::within_tol((a), (b), (n), (tol));\
+    if (ar.count() > 0 && ut_test.will_report()) {\
+        ar.show();\
+    }\
+    ut_test.check_eq(ar.count() == 0, __FUNCTION__, __LINE__, __FILE__, 0);\
+}
+#define EXPECT_ARRAY_ULP(a,b,n,maxulp)\
+{\
+    ut_array_result ar = ut_array_cmp::within_ulp((a), (b), (n), (maxulp));\
+    if (ar.count() > 0 && ut_test.will_report()) {\
+        ar.show();\
+    }\
+    ut_test.check_eq(ar.count() == 0, __FUNCTION__, __LINE__, __FILE__, 0);\
+}
+#define EXPECT_BUFFER_EQ(a,b,len)\
+{\
+    ut_buffer_result br = ut_buffer_cmp::compare((a), (b), (len));\
+    if (br.count() > 0 && ut_test.will_report()) {\
+        br.show();\
+    }\
+    ut_test.check_eq(br.count() == 0, __FUNCTION__, __LINE__, __FILE__, 0);\
+}
+// data is a string, a char or byte vector, or a producer taking a
+// ut_golden& to write() the output into piece by piece
+#define EXPECT_MATCHES_GOLDEN(path,data)\
+{\
+    std::string gm;\
+    bool eq = ut_golden::match((path), data, gm);\
+    if (eq == false && ut_test.will_report()) {\
+        TIP("%s", gm.c_str());\
+    }\
+    ut_test.check_eq(eq, __FUNCTION__, __LINE__, __FILE__, 0);\
+}
+#define EXPECT_PERCENTILE_BELOW(h,p,ns)\
+{\
+    ut_u64 pv = (h).percentile(p), lim = (ns);\
+    bool eq = pv < lim;\
+    if (eq == false && ut_test.will_report()) {\
+        TIP("Expect: p%g below %llu ns, Return Value: %llu ns",\
+        (double)(p), (unsigned long long)lim, (unsigned long long)pv);\
+    }\
+    ut_test.check_eq(eq, __FUNCTION__, __LINE__, __FILE__, 0);\
+}
+#ifdef VTEST_HAS_MEMSTAT
+#define EXPECT_PEAK_RSS_BELOW(bytes)\
+{\
+    long long pv = ut_mem.peak(), lim = (long long)(bytes);\
+    bool eq = pv >= 0 && pv < lim;\
+    if (eq == false && ut_test.will_report()) {\
+        if (pv < 0) {\
+            TIP("Expect: peak RSS growth below %lld bytes, the test is not tracked,"\
+            " mark it with VTEST_MEMORY or run with --memory", lim);\
+        }\
+        else {\
+            TIP("Expect: peak RSS growth below %lld bytes, Return Value: %lld bytes",\
+            lim, pv);\
+        }\
+    }\
+    ut_test.check_eq(eq, __FUNCTION__, __LINE__, __FILE__, 0);\
+}
+#endif
+#define EXPECT_P50_BELOW(h,ns) EXPECT_PERCENTILE_BELOW(h, 50, ns)
+#define EXPECT_P99_BELOW(h,ns) EXPECT_PERCENTILE_BELOW(h, 99, ns)
+#define EXPECT_MAX_BELOW(h,ns) EXPECT_PERCENTILE_BELOW(h, 100, ns)
 
 #define BAT_CHECK_EQ(i,a,b)\
 {\
     ut_var v1 = (a), v2 = (b);\
     bool eq = (v1 == v2);\
-    if (eq == false) {\
+    if (eq == false && ut_test.will_report()) {\
         TIP("Expect: %s, Return Value: %s",\
         v1.to_str().c_str(), v2.to_str().c_str());\
     }\
@@ -764,109 +5403,204 @@ namespace vtest
 }
 #define BAT_CHECK_1(x,v)\
 {\
-    for (size_t i = 0; i < v.size(); i++)\
+    ut_batch ub;\
+    for (size_t i = 0; i < v.size() && ub.more(i, v.size()); i++)\
         BAT_CHECK_EQ(i, true,x(v[i][0]));\
 }
 #define BAT_CHECK_2(x,v)\
 {\
-    for (size_t i = 0; i < v.size(); i++)\
+    ut_batch ub;\
+    for (size_t i = 0; i < v.size() && ub.more(i, v.size()); i++)\
         BAT_CHECK_EQ(i, true,x(v[i][0], v[i][1]));\
 }
 #define BAT_CHECK_3(x,v)\
 {\
-    for (size_t i = 0; i < v.size(); i++)\
+    ut_batch ub;\
+    for (size_t i = 0; i < v.size() && ub.more(i, v.size()); i++)\
         BAT_CHECK_EQ(i, true,x(v[i][0], v[i][1], v[i][2]));\
 }
 #define BAT_CHECK_4(x,v)\
 {\
-    for (size_t i = 0; i < v.size(); i++)\
+    ut_batch ub;\
+    for (size_t i = 0; i < v.size() && ub.more(i, v.size()); i++)\
         BAT_CHECK_EQ(i, true,x(v[i][0], v[i][1], v[i][2], v[i][3]));\
 }
 #define BAT_CHECK_5(x,v)\
 {\
-    for (size_t i = 0; i < v.size(); i++)\
+    ut_batch ub;\
+    for (size_t i = 0; i < v.size() && ub.more(i, v.size()); i++)\
         BAT_CHECK_EQ(i, true,x(v[i][0], v[i][1], v[i][2], v[i][3], v[i][4]));\
 }
 #define BAT_CHECK_6(x,v)\
 {\
-    for (size_t i = 0; i < v.size(); i++)\
+    ut_batch ub;\
+    for (size_t i = 0; i < v.size() && ub.more(i, v.size()); i++)\
         BAT_CHECK_EQ(i, true,x(v[i][0], v[i][1], v[i][2], v[i][3], v[i][4]\
             , v[i][5]));\
 }
 #define BAT_CHECK_7(x,v)\
 {\
-    for (size_t i = 0; i < v.size(); i++)\
+    ut_batch ub;\
+    for (size_t i = 0; i < v.size() && ub.more(i, v.size()); i++)\
         BAT_CHECK_EQ(i, true,x(v[i][0], v[i][1], v[i][2], v[i][3], v[i][4]\
             , v[i][5], v[i][6]));\
 }
 #define BAT_CHECK_8(x,v)\
 {\
-    for (size_t i = 0; i < v.size(); i++)\
+    ut_batch ub;\
+    for (size_t i = 0; i < v.size() && ub.more(i, v.size()); i++)\
         BAT_CHECK_EQ(i, true,x(v[i][0], v[i][1], v[i][2], v[i][3], v[i][4]\
             , v[i][5], v[i][6], v[i][7]));\
 }
 #define BAT_CHECK_9(x,v)\
 {\
-    for (size_t i = 0; i < v.size(); i++)\
+    ut_batch ub;\
+    for (size_t i = 0; i < v.size() && ub.more(i, v.size()); i++)\
         BAT_CHECK_EQ(i, true,x(v[i][0], v[i][1], v[i][2], v[i][3], v[i][4]\
             , v[i][5], v[i][6], v[i][7], v[i][8]));\
 }
 #define VBAT_CHECK_1(x,v)\
 {\
-    for (size_t i = 0; i < v.size(); i++)\
+    ut_batch ub;\
+    for (size_t i = 0; i < v.size() && ub.more(i, v.size()); i++)\
         BAT_CHECK_EQ(i, v[i][0],x(v[i][1]));\
 }
 #define VBAT_CHECK_2(x,v)\
 {\
-    for (size_t i = 0; i < v.size(); i++)\
+    ut_batch ub;\
+    for (size_t i = 0; i < v.size() && ub.more(i, v.size()); i++)\
         BAT_CHECK_EQ(i, v[i][0],x(v[i][1], v[i][2]));\
 }
 #define VBAT_CHECK_3(x,v)\
 {\
-    for (size_t i = 0; i < v.size(); i++)\
+    ut_batch ub;\
+    for (size_t i = 0; i < v.size() && ub.more(i, v.size()); i++)\
         BAT_CHECK_EQ(i, v[i][0],x(v[i][1], v[i][2], v[i][3]));\
 }
 #define VBAT_CHECK_4(x,v)\
 {\
-    for (size_t i = 0; i < v.size(); i++)\
+    ut_batch ub;\
+    for (size_t i = 0; i < v.size() && ub.more(i, v.size()); i++)\
         BAT_CHECK_EQ(i, v[i][0],x(v[i][1], v[i][2], v[i][3], v[i][4]));\
 }
 #define VBAT_CHECK_5(x,v)\
 {\
-    for (size_t i = 0; i < v.size(); i++)\
+    ut_batch ub;\
+    for (size_t i = 0; i < v.size() && ub.more(i, v.size()); i++)\
         BAT_CHECK_EQ(i, v[i][0],x(v[i][1], v[i][2], v[i][3], v[i][4]\
         , v[i][5]));\
 }
 #define VBAT_CHECK_6(x,v)\
 {\
-    for (size_t i = 0; i < v.size(); i++)\
+    ut_batch ub;\
+    for (size_t i = 0; i < v.size() && ub.more(i, v.size()); i++)\
         BAT_CHECK_EQ(i, v[i][0],x(v[i][1], v[i][2], v[i][3], v[i][4]\
             , v[i][5], v[i][6]));\
 }
 #define VBAT_CHECK_7(x,v)\
 {\
-    for (size_t i = 0; i < v.size(); i++)\
+    ut_batch ub;\
+    for (size_t i = 0; i < v.size() && ub.more(i, v.size()); i++)\
         BAT_CHECK_EQ(i, v[i][0],x(v[i][1], v[i][2], v[i][3], v[i][4]\
             , v[i][5], v[i][6], v[i][7]));\
 }
 #define VBAT_CHECK_8(x,v)\
 {\
-    for (size_t i = 0; i < v.size(); i++)\
+    ut_batch ub;\
+    for (size_t i = 0; i < v.size() && ub.more(i, v.size()); i++)\
         BAT_CHECK_EQ(i, v[i][0],x(v[i][1], v[i][2], v[i][3], v[i][4]\
             , v[i][5], v[i][6], v[i][7], v[i][8]));\
 }
 #define VBAT_CHECK_9(x,v)\
 {\
-    for (size_t i = 0; i < v.size(); i++)\
+    ut_batch ub;\
+    for (size_t i = 0; i < v.size() && ub.more(i, v.size()); i++)\
         BAT_CHECK_EQ(i, v[i][0],x(v[i][1], v[i][2], v[i][3], v[i][4]\
             , v[i][5], v[i][6], v[i][7], v[i][8], v[i][9]));\
 }
 #define VTEST(x)\
     void x();\
-    ut_func_holder __ufo_##x((void *)x, #x);\
+    ut_func_holder __ufo_##x((void *)x, #x, false, __FILE__, __LINE__);\
     void x()
-#define VTEST_ADD(x) ut_test.add_func((void *)x, #x, false);
-#define VTEST_TOP_ADD(x) ut_test.add_func((void *)x, #x, true);
+// the body is a struct closed with };, CEXPECT checks are static_asserts
+// that fail the build with the expression, at run time only their count
+// is reported
+#define VTEST_CONSTEXPR(x)\
+    struct __uce_##x;\
+    ut_func_holder __ufo_##x((void *)ut_constexpr_run<__uce_##x>, #x, false, __FILE__, __LINE__);\
+    struct __uce_##x : ut_constexpr_base
+#define UT_CE_CAT2(a,b) a##b
+#define UT_CE_CAT(a,b) UT_CE_CAT2(a,b)
+#define CEXPECT(x)\
+    static_assert((x), "CEXPECT(" #x ")");\
+    char UT_CE_CAT(__uce_, __COUNTER__);
+#define CEXPECT_EQ(a,b)\
+    static_assert((a) == (b), "CEXPECT_EQ(" #a ", " #b ")");\
+    char UT_CE_CAT(__uce_, __COUNTER__);
+#define VTEST_STRESS(x, threads, iterations)\
+    void x(ut_stress_ctx& ctx);\
+    void __ust_##x()\
+    {\
+        ut_stress::exec(#x, x, threads, iterations, 0);\
+    }\
+    ut_func_holder __ufo_##x((void *)__ust_##x, #x, false, __FILE__, __LINE__);\
+    void x(ut_stress_ctx& ctx)
+#define VTEST_STRESS_TIMED(x, threads, ms)\
+    void x(ut_stress_ctx& ctx);\
+    void __ust_##x()\
+    {\
+        ut_stress::exec(#x, x, threads, 0, ms);\
+    }\
+    ut_func_holder __ufo_##x((void *)__ust_##x, #x, false, __FILE__, __LINE__);\
+    void x(ut_stress_ctx& ctx)
+#define VTEST_BENCH(x, iterations)\
+    void x(ut_stress_ctx& ctx);\
+    void __ubh_##x()\
+    {\
+        ut_stress::bench(#x, x, iterations);\
+    }\
+    ut_func_holder __ufo_##x((void *)__ubh_##x, #x, false, __FILE__, __LINE__);\
+    void x(ut_stress_ctx& ctx)
+// sizes lo, 2 lo, 4 lo ... hi, the body gets the size from ctx.range()
+#define VTEST_BENCH_RANGE(x, lo, hi)\
+    void x(ut_stress_ctx& ctx);\
+    void __ubr_##x()\
+    {\
+        ut_stress::bench_range(#x, x, lo, hi);\
+    }\
+    ut_func_holder __ufo_##x((void *)__ubr_##x, #x, false, __FILE__, __LINE__);\
+    void x(ut_stress_ctx& ctx)
+// the fit of a VTEST_BENCH_RANGE must be model or better, model is one of
+// O_1, O_LOGN, O_N, O_NLOGN, O_N2
+#define VTEST_COMPLEXITY_EXPECT(x, model)\
+    ut_complexity_holder __ucx_##x(#x, ut_complexity::model, __FILE__, __LINE__);
+#define VTEST_SCALING_EXPECT(x, threads, efficiency)\
+    ut_scaling_holder __usc_##x##_##threads(#x, threads, efficiency,\
+        __FILE__, __LINE__);
+#ifdef VTEST_HAS_COROUTINE
+#define VTEST_ASYNC_TIMED(x, ms)\
+    ut_task x();\
+    void __uas_##x()\
+    {\
+        ut_loop::instance().spawn(#x, x(), ms, __FILE__, __LINE__);\
+    }\
+    ut_func_holder __ufo_##x((void *)__uas_##x, #x, false, __FILE__, __LINE__);\
+    ut_task x()
+#define VTEST_ASYNC(x) VTEST_ASYNC_TIMED(x, VTEST_ASYNC_TIMEOUT)
+#endif
+#define VTEST_ADD(x) ut_test.add_func((void *)x, #x, false, __FILE__, __LINE__);
+#define VTEST_TOP_ADD(x) ut_test.add_func((void *)x, #x, true, __FILE__, __LINE__);
+#define VTEST_DEPENDS(b, a) ut_depend_holder __udp_##b##_##a(#b, #a);
+#define VTEST_TRACE_SCOPE(name) ut_trace_scope UT_CE_CAT(__uts_, __LINE__)(name);
+// threads and memory in MB a test or every test of a region needs
+#define VTEST_RESOURCES(x, threads, mb) ut_resource_holder __urs_##x(#x, false, threads, mb, false);
+#define VTEST_EXCLUSIVE(x) ut_resource_holder __urs_##x(#x, false, 1, 0, true);
+#define VTEST_REGION_RESOURCES(x, threads, mb) ut_resource_holder __urr_##x(#x, true, threads, mb, false);
+#define VTEST_REGION_EXCLUSIVE(x) ut_resource_holder __urr_##x(#x, true, 1, 0, true);
+#ifdef VTEST_HAS_MEMSTAT
+// track the peak RSS and the page faults of the test, see ut_memstat
+#define VTEST_MEMORY(x) ut_memory_holder __umt_##x(#x);
+#endif
 #define VTEST_RUN_ALL() ut_test.run_all();
 #define VTEST_REGION_PUSH(x) ut_level_holder __ulo_##x(#x);
 #define VTEST_REGION_POP(x) ut_level_holder __ulc_##x("__root__");
@@ -880,4 +5614,155 @@ namespace vtest
 
 } // namespace
 
+// counts the live allocations for the --repeat leak trend, define it in
+// one source file only. a header before each block remembers the counter
+// it was charged to, the running test's or none for the framework's own
+#ifdef VTEST_TRACK_ALLOC
+namespace vtest
+{
+    // head is a multiple of the alignment, the counter sits at the block
+    // start, the total when no test runs on the thread
+    inline void* ut_track_alloc(size_t n, size_t head)
+    {
+        char* b;
+        if (head <= alignof(std::max_align_t)) {
+            b = (char*)malloc(n + head);
+        }
+        else {
+#ifdef _MSC_VER
+            b = (char*)_aligned_malloc(n + head, head);
+#else
+            void* v = NULL;
+            b = posix_memalign(&v, head, n + head) == 0 ? (char*)v : NULL;
+#endif
+        }
+        if (b == NULL) return NULL;
+        std::atomic<long long>* owner = NULL;
+        if (ut_alloc_quiet() == 0) {
+            unit_test::test_node* t = unit_test::current_test();
+            owner = t && t->allocs ? t->allocs : &ut_live_allocs();
+            ut_live_allocs().fetch_add(1, std::memory_order_relaxed);
+            if (owner != &ut_live_allocs()) {
+                owner->fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        *(std::atomic<long long>**)b = owner;
+        return b + head;
+    }
+    inline void ut_track_free(void* p, size_t head)
+    {
+        if (p == NULL) return;
+        char* b = (char*)((size_t)p - head);
+        std::atomic<long long>* owner = *(std::atomic<long long>**)b;
+        if (owner) {
+            ut_live_allocs().fetch_sub(1, std::memory_order_relaxed);
+            if (owner != &ut_live_allocs()) {
+                owner->fetch_sub(1, std::memory_order_relaxed);
+            }
+        }
+#ifdef _MSC_VER
+        if (head > alignof(std::max_align_t)) {
+            _aligned_free(b);
+            return;
+        }
+#endif
+        free(b);
+    }
+#ifdef __cpp_aligned_new
+    // over aligned types, the header grows to the alignment
+    inline size_t ut_track_head(std::align_val_t al)
+    {
+        return (size_t)al > alignof(std::max_align_t) ? (size_t)al
+            : alignof(std::max_align_t);
+    }
+#endif
+}
+void* operator new(size_t n)
+{
+    void* p = vtest::ut_track_alloc(n, alignof(std::max_align_t));
+    if (p == NULL) throw std::bad_alloc();
+    return p;
+}
+void* operator new[](size_t n)
+{
+    return operator new(n);
+}
+void* operator new(size_t n, const std::nothrow_t&) noexcept
+{
+    return vtest::ut_track_alloc(n, alignof(std::max_align_t));
+}
+void* operator new[](size_t n, const std::nothrow_t&) noexcept
+{
+    return vtest::ut_track_alloc(n, alignof(std::max_align_t));
+}
+void operator delete(void* p) noexcept
+{
+    vtest::ut_track_free(p, alignof(std::max_align_t));
+}
+void operator delete[](void* p) noexcept
+{
+    operator delete(p);
+}
+void operator delete(void* p, size_t) noexcept
+{
+    operator delete(p);
+}
+void operator delete[](void* p, size_t) noexcept
+{
+    operator delete(p);
+}
+void operator delete(void* p, const std::nothrow_t&) noexcept
+{
+    operator delete(p);
+}
+void operator delete[](void* p, const std::nothrow_t&) noexcept
+{
+    operator delete(p);
+}
+#ifdef __cpp_aligned_new
+void* operator new(size_t n, std::align_val_t al)
+{
+    void* p = vtest::ut_track_alloc(n, vtest::ut_track_head(al));
+    if (p == NULL) throw std::bad_alloc();
+    return p;
+}
+void* operator new[](size_t n, std::align_val_t al)
+{
+    return operator new(n, al);
+}
+void* operator new(size_t n, std::align_val_t al, const std::nothrow_t&) noexcept
+{
+    return vtest::ut_track_alloc(n, vtest::ut_track_head(al));
+}
+void* operator new[](size_t n, std::align_val_t al, const std::nothrow_t&) noexcept
+{
+    return vtest::ut_track_alloc(n, vtest::ut_track_head(al));
+}
+void operator delete(void* p, std::align_val_t al) noexcept
+{
+    vtest::ut_track_free(p, vtest::ut_track_head(al));
+}
+void operator delete[](void* p, std::align_val_t al) noexcept
+{
+    operator delete(p, al);
+}
+void operator delete(void* p, size_t, std::align_val_t al) noexcept
+{
+    operator delete(p, al);
+}
+void operator delete[](void* p, size_t, std::align_val_t al) noexcept
+{
+    operator delete(p, al);
+}
+void operator delete(void* p, std::align_val_t al, const std::nothrow_t&) noexcept
+{
+    operator delete(p, al);
+}
+void operator delete[](void* p, std::align_val_t al, const std::nothrow_t&) noexcept
+{
+    operator delete(p, al);
+}
+#endif
+#endif
+
 #endif // __V_TEST_H__